@@ -2,6 +2,8 @@
 
 import matplotlib.pyplot as plt
 
+import json
+import os
 import subprocess
 import time
 import sys
@@ -162,4 +164,78 @@ def run_test():
     #plot_results(results)
     
 
-run_test()
\ No newline at end of file
+# plots the results of the in-process benchmarks (make bench): one chart per operation, with the
+# median, p99 and p99.9 of every implementation
+def plot_json(paths):
+    runs = []
+    for path in paths:
+        with open(path) as f:
+            runs.append(json.load(f))
+    impls = [run["impl"] for run in runs]
+    labels = [impl if impls.count(impl) == 1 else f"{impl} ({os.path.basename(path)})"
+              for impl, path in zip(impls, paths)]
+
+    names = []
+    for run in runs:
+        for bench in run["benchmarks"]:
+            if bench["name"] not in names:
+                names.append(bench["name"])
+    stats = [("median_ns", "median"), ("p99_ns", "p99"), ("p999_ns", "p99.9")]
+
+    fig, axes = plt.subplots(1, len(names), figsize=(4 * len(names), 4), squeeze=False)
+    width = 0.8 / len(runs)
+    for ax, name in zip(axes[0], names):
+        for i, (run, label) in enumerate(zip(runs, labels)):
+            bench = next((b for b in run["benchmarks"] if b["name"] == name), None)
+            if bench is None:
+                continue
+            ax.bar([j + i * width for j in range(len(stats))], [bench[key] for key, _ in stats], width, label=label)
+        ax.set_xticks([j + width * (len(runs) - 1) / 2 for j in range(len(stats))])
+        ax.set_xticklabels([stat_name for _, stat_name in stats])
+        ax.set_yscale("log")
+        ax.set_ylabel("Time in ns per operation")
+        ax.set_title(name)
+        ax.legend()
+    plt.tight_layout()
+    plt.show()
+
+
+# plots the latency distribution of every operation (histograms with power of 2 buckets written by
+# make bench), to compare the tails of the implementations
+def plot_histograms(paths):
+    runs = []
+    for path in paths:
+        with open(path) as f:
+            runs.append((os.path.basename(path), json.load(f)))
+
+    names = []
+    for _, run in runs:
+        for bench in run["benchmarks"]:
+            if bench["name"] not in names:
+                names.append(bench["name"])
+
+    fig, axes = plt.subplots(1, len(names), figsize=(4 * len(names), 4), squeeze=False)
+    for ax, name in zip(axes[0], names):
+        for label, run in runs:
+            bench = next((b for b in run["benchmarks"] if b["name"] == name), None)
+            if bench is None:
+                continue
+            buckets = [bucket for bucket, _ in bench["histogram"]]
+            counts = [count / bench["samples"] for _, count in bench["histogram"]]
+            ax.step(buckets, counts, where="post", label=f"{run['impl']} ({label})")
+        ax.set_xscale("log", base=2)
+        ax.set_yscale("log")
+        ax.set_xlabel("Time in ns per operation")
+        ax.set_ylabel("Fraction of the samples")
+        ax.set_title(name)
+        ax.legend()
+    plt.tight_layout()
+    plt.show()
+
+
+if len(sys.argv) > 2 and sys.argv[1] == "--json":
+    plot_json(sys.argv[2:])
+elif len(sys.argv) > 2 and sys.argv[1] == "--hist":
+    plot_histograms(sys.argv[2:])
+else:
+    run_test()
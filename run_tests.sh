@@ -1,10 +1,10 @@
 #!/bin/bash
 
 executable_path="./install/bin/"
-base_names=("01-main" "02-switch" "03-equity" "11-join" "12-join-main"
-    "21-create-many" "22-create-many-recursive" "23-create-many-once"
-    "31-switch-many" "32-switch-many-join" "33-switch-many-cascade"
-    "51-fibonacci" "61-mutex" "62-mutex" "63-mutex-equity" "64-mutex-join" "71-preemption" "81-deadlock" "91-priority")
+base_names=("01-main" "02-switch" "03-equity" "04-stats" "05-yield-to" "11-join" "12-join-main" "13-join-stale"
+    "21-create-many" "22-create-many-recursive" "23-create-many-once" "24-thread-pool" "25-create-many-batch" "26-create-many-exit-main"
+    "31-switch-many" "32-switch-many-join" "33-switch-many-cascade" "41-key-specific"
+    "51-fibonacci" "52-fibonacci-async" "53-fibonacci-task" "61-mutex" "62-mutex" "63-mutex-equity" "64-mutex-join" "65-wait-wake" "66-mutex-trylock" "67-mutex-profile" "68-wait-fd" "69-wake-external" "71-preemption" "72-should-yield" "81-deadlock" "91-priority")
 
 # Definitions for base test names and number of parameters
 declare -A num_params
@@ -26,6 +26,16 @@ defaut_params[23-create-many-once]="10000"
 defaut_graph_params[23-create-many-once]="lin 1 40 1"
 param_descriptions[23-create-many-once]="number of threads"
 
+num_params[24-thread-pool]=1
+defaut_params[24-thread-pool]="10000"
+defaut_graph_params[24-thread-pool]="lin 1 40 1"
+param_descriptions[24-thread-pool]="number of jobs"
+
+num_params[25-create-many-batch]=1
+defaut_params[25-create-many-batch]="10000"
+defaut_graph_params[25-create-many-batch]="lin 1 40 1"
+param_descriptions[25-create-many-batch]="number of threads"
+
 num_params[31-switch-many]=2
 defaut_params[31-switch-many]="10 10000"
 defaut_graph_params[31-switch-many]="lin 1 40 1 lin 1 40 1"
@@ -46,6 +56,16 @@ defaut_params[51-fibonacci]="23"
 defaut_graph_params[51-fibonacci]="lin 1 15 1"
 param_descriptions[51-fibonacci]="Fibonacci number to calculate"
 
+num_params[52-fibonacci-async]=1
+defaut_params[52-fibonacci-async]="23"
+defaut_graph_params[52-fibonacci-async]="lin 1 15 1"
+param_descriptions[52-fibonacci-async]="Fibonacci number to calculate"
+
+num_params[53-fibonacci-task]=1
+defaut_params[53-fibonacci-task]="23"
+defaut_graph_params[53-fibonacci-task]="lin 1 15 1"
+param_descriptions[53-fibonacci-task]="Fibonacci number to calculate"
+
 num_params[61-mutex]=1
 defaut_params[61-mutex]="20"
 defaut_graph_params[61-mutex]="lin 1 20 1"
@@ -74,12 +94,15 @@ param_descriptions[71-preemption]="number of threads"
 mode="normal"
 
 # Parse command line options
-while getopts "vg" opt; do
+while getopts "vglsp" opt; do
     case "$opt" in
     v) mode="valgrind" ;;
     g) mode="graphs" ;;
+    l) mode="lazy" ;;
+    s) mode="shared" ;;
+    p) mode="shim" ;;
     *)
-        echo "Usage: $0 [-v (valgrind) | -g (graphs)]"
+        echo "Usage: $0 [-v (valgrind) | -g (graphs) | -l (lazy threads) | -s (shared stacks) | -p (pthread tests under libthread-pthread.so)]"
         exit 1
         ;;
     esac
@@ -143,6 +166,18 @@ run_test() {
         $executable_path${base_name}-pthread $parameters
         echo "-----------------------"
         ;;
+    lazy)
+        $executable_path${base_name}-lazy $parameters
+        echo "-----------------------"
+        ;;
+    shared)
+        $executable_path${base_name}-shared $parameters
+        echo "-----------------------"
+        ;;
+    shim)
+        LD_PRELOAD=./install/lib/libthread-pthread.so $executable_path${base_name}-pthread $parameters
+        echo "-----------------------"
+        ;;
     valgrind)
         valgrind --leak-check=full --show-leak-kinds=all --track-origins=yes "$executable_path$base_name" $parameters
         echo "-----------------------"
@@ -158,6 +193,10 @@ for base_name in "${base_names[@]}"; do
     if [ "$mode" == "graphs" ] && ! [[ -n ${num_params[$base_name]} ]]; then
         continue
     fi
+    # libthreadlazy and libthreadshared have no preemption
+    if { [ "$mode" == "lazy" ] || [ "$mode" == "shared" ]; } && [ "$base_name" == "71-preemption" ]; then
+        continue
+    fi
 
     echo $base_name $mode ${num_params[$base_name]}
     base_default_params=""
@@ -256,6 +256,80 @@
         } \
     } while (0)
 
+/**
+ * @brief Inserts at once the nb objects of a contiguous array, all having the same key,
+ * not greater than any key of the tree
+ *
+ * The first nb - 1 objects are linked into a complete tree (children of i at 2i + 1 and
+ * 2i + 2, its partial last level red), then joined to the tree through the last object:
+ * it is put in place of the black node of the left spine of the tree (or of the right
+ * spine of the new one, if the tree is lower) having the same black height as the other
+ * tree, and the insertion repair fixes the colors from there.
+ * Linear in nb, instead of nb * log(size of the tree) for nb BRTREE_INSERT.
+ *
+ * @param array Pointer to the first object, their entries don't need to be initialized
+ * @param nb The number of objects
+ * @param _key Their key
+ * @param tree Pointer to the tree to insert in
+ * @param type The type of the objects
+*/
+#define BRTREE_INSERT_MIN_MANY(array, nb, _key, tree, type) \
+    do { \
+        struct type *first_many = (array); \
+        size_t nb_many = (nb), i_many, full_many = 0, level_end_many = 1, depth_many = 0; \
+        if (nb_many == 0) break; \
+        struct type *pivot_many = &first_many[nb_many - 1]; \
+        BRTREE_ENTRY_INITIALIZE(pivot_many, _key); \
+        /* complete tree of the nb - 1 first objects, full_many levels of black nodes */ \
+        while ((((size_t)1 << (full_many + 1)) - 1) <= nb_many - 1) full_many++; \
+        for (i_many = 0; i_many < nb_many - 1; i_many++) { \
+            struct type *n_many = &first_many[i_many]; \
+            if (i_many == level_end_many) { depth_many++; level_end_many = 2 * level_end_many + 1; } \
+            BRTREE_KEY(n_many) = (_key); \
+            BRTREE_PARENT(n_many) = i_many == 0 ? NULL : &first_many[(i_many - 1) / 2]; \
+            BRTREE_LCHILD(n_many) = 2 * i_many + 1 < nb_many - 1 ? &first_many[2 * i_many + 1] : BRTREE_LEAF; \
+            BRTREE_RCHILD(n_many) = 2 * i_many + 2 < nb_many - 1 ? &first_many[2 * i_many + 2] : BRTREE_LEAF; \
+            BRTREE_COLOR(n_many) = depth_many < full_many ? BRTREE_COLOR_BLACK : BRTREE_COLOR_RED; \
+        } \
+        struct type *new_root_many = nb_many > 1 ? first_many : NULL; \
+        size_t old_height_many = 0; \
+        struct type *cur_many = BRTREE_ROOT(tree), *parent_many = NULL; \
+        for (; cur_many != NULL; cur_many = BRTREE_LCHILD(cur_many)) \
+            if (BRTREE_IS_BLACK(cur_many)) old_height_many++; \
+        size_t height_many = old_height_many; \
+        if (old_height_many >= full_many) { \
+            /* the new tree goes left of the pivot, in place of a node of the left spine */ \
+            cur_many = BRTREE_ROOT(tree); \
+            while (cur_many != NULL && (!BRTREE_IS_BLACK(cur_many) || height_many > full_many)) { \
+                if (BRTREE_IS_BLACK(cur_many)) height_many--; \
+                parent_many = cur_many; \
+                cur_many = BRTREE_LCHILD(cur_many); \
+            } \
+            BRTREE_LCHILD(pivot_many) = new_root_many; \
+            BRTREE_RCHILD(pivot_many) = cur_many; \
+            if (parent_many != NULL) BRTREE_LCHILD(parent_many) = pivot_many; \
+        } else { \
+            /* the tree goes right of the pivot, in place of a node of the right spine of the new one */ \
+            height_many = full_many; \
+            cur_many = new_root_many; \
+            while (cur_many != NULL && (!BRTREE_IS_BLACK(cur_many) || height_many > old_height_many)) { \
+                if (BRTREE_IS_BLACK(cur_many)) height_many--; \
+                parent_many = cur_many; \
+                cur_many = BRTREE_RCHILD(cur_many); \
+            } \
+            BRTREE_LCHILD(pivot_many) = cur_many; \
+            BRTREE_RCHILD(pivot_many) = BRTREE_ROOT(tree); \
+            if (BRTREE_ROOT(tree) != NULL) BRTREE_PARENT(BRTREE_ROOT(tree)) = pivot_many; \
+            if (parent_many != NULL) BRTREE_RCHILD(parent_many) = pivot_many; \
+            BRTREE_ROOT(tree) = new_root_many; \
+        } \
+        BRTREE_PARENT(pivot_many) = parent_many; \
+        if (BRTREE_LCHILD(pivot_many) != NULL) BRTREE_PARENT(BRTREE_LCHILD(pivot_many)) = pivot_many; \
+        if (BRTREE_RCHILD(pivot_many) != NULL) BRTREE_PARENT(BRTREE_RCHILD(pivot_many)) = pivot_many; \
+        if (parent_many == NULL) BRTREE_ROOT(tree) = pivot_many; \
+        BRTREE_INSERT_REPAIR_TREE(pivot_many, tree, type); \
+    } while (0)
+
 #define BRTREE_MIN(root, res) \
     do { \
         res = root; \
@@ -1,4 +1,6 @@
 #define _XOPEN_SOURCE 700
+#define _DEFAULT_SOURCE // MAP_ANONYMOUS
+#define _GNU_SOURCE // dladdr
 
 #include "thread.h"
 #include "black_red_tree.h"
@@ -14,11 +16,39 @@
 #include <signal.h>
 #include <sys/time.h>
 #include <errno.h>
+#include <cpuid.h>
+#include <string.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <limits.h>
+#include <setjmp.h>
+#include <dlfcn.h>
+#include <link.h>
+#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
 
 #define MAIN_THREAD_ID 1
 #define MAX_YIELD_UNTIL_REORDER 4
-#define MAX_CPU_TIME_UNTIL_REORDER 2000 * 1000
+#define MAX_CPU_TIME_UNTIL_REORDER 700 * 1000 // in ns
+#define TRACE_DEFAULT_NB_EVENTS 1024 * 1024
+#define CALIBRATION_TIME 2 * 1000 * 1000 // in ns, only used when the cpu doesn't give the TSC frequency
 #define PREEMPT_TIME_INTERVAL 2100 // in us
+#define PREEMPT_RETRY_INTERVAL 100 // in us, before retrying a tick that interrupted the C library
+#define SLICE_TIME_INTERVAL 700 // in us of cpu time, raises thread_yield_pending without preemption
+#define THREAD_DESTRUCTOR_ITERATIONS 4 // same as PTHREAD_DESTRUCTOR_ITERATIONS
+#define WAIT_TABLE_SIZE 256 // buckets of the thread_wait_on table, a power of 2
+#define TASK_WORKERS 4 // threads running the pending tasks, created by the first thread_task_spawn
+#define TASK_WORKERS_MAX 64 // bound of the workers started while all the others are blocked in a task
+#define STACK_CACHE_SIZE 16 // stacks of terminated threads kept for the next ones
+#define SHARED_STACKS 4 // run stacks of the USE_SHARED_STACK mode
+#define SWITCHER_STACK_SIZE 64 * 1024 // stack copying between threads in the USE_SHARED_STACK mode
+#define THREAD_TABLE_INITIAL_SIZE 64 // slots of the handle table, doubled when full
+#define FD_POLL_INTERVAL 100 * 1000 // in ns, between two checks of the descriptors while threads are runnable
+#define FD_POLL_EVENTS 64 // descriptors made ready by one epoll_wait
+#define FD_CHECK_INTERVAL 50 * 1000 * 1000 // in ns, between two checks that the waited descriptors are still open
+#define MUTEX_MAX_YIELDS_TO_OWNER 8 // directed yields of a contended lock before it parks
+#define MUTEX_WAIT_EWMA_SHIFT 3 // weight 1/8 of the last wait in the mean of the mutex
 #define MULTIPLIERS_VALUES 10000000, 7943282, 6309573, 5011872, 3981071, 3162277, 2511886, 1995262, 1584893, 1258925, 1000000, 794328, 630957, 501187, 398107, 316227, 251188, 199526, 158489, 125892, 100000, 79432, 63095, 50118, 39810, 31622, 25118, 19952, 15848, 12589, 10000, 7943, 6309, 5011, 3981, 3162, 2511, 1995, 1584, 1258
 
 #ifdef USE_PREEMPTION
@@ -29,34 +59,253 @@
 #define USE_PREEMPTION 0
 #endif
 
+#ifdef USE_LAZY_THREADS
+#undef USE_LAZY_THREADS
+#define USE_LAZY_THREADS 1
+#else
+#define USE_LAZY_THREADS 0
+#endif
+
+#ifdef USE_SHARED_STACK
+#undef USE_SHARED_STACK
+#define USE_SHARED_STACK 1
+#else
+#define USE_SHARED_STACK 0
+#endif
+
 typedef enum thread_state
 {
     READY,
     TERMINATED
 } thread_state;
 
+// What a thread is waiting for, used for the scheduling statistics
+typedef enum thread_wait_reason
+{
+    WAIT_RUNNABLE,
+    WAIT_MUTEX,
+    WAIT_JOIN,
+    WAIT_ADDRESS,
+    WAIT_FD,
+    WAIT_PARK
+} thread_wait_reason;
+
+/* Scheduling trace: a ring buffer of fixed-size events, preceded by a header.
+ * The layout is the file format read by trace_to_json.py, keep them in sync.
+ */
+typedef enum trace_event_type
+{
+    TRACE_SWITCH,  // thread gives the cpu to arg
+    TRACE_CREATE,  // thread creates arg
+    TRACE_EXIT,    // thread terminates
+    TRACE_BLOCK,   // thread blocks on arg (owner of the mutex or thread joined), for reason
+    TRACE_WAKE,    // thread makes arg runnable again
+    TRACE_PREEMPT  // thread is preempted by the timer
+} trace_event_type;
+
+struct trace_event
+{
+    uint64_t ticks;
+    uint32_t type;
+    uint32_t thread;
+    uint32_t arg;
+    uint32_t reason;
+};
+
+struct trace_header
+{
+    char magic[8]; // "THRTRACE"
+    uint32_t version;
+    uint32_t event_size;
+    uint64_t nb_events;     // capacity of the ring buffer
+    uint64_t head;          // number of events ever written, the next one goes to head % nb_events
+    uint64_t start_ticks;
+    double ns_per_tick;
+    uint64_t reserved[2];   // pads the header to 64 bytes
+};
+
+/* Thread-specific data: a key is an index in the slot array of each thread.
+ * A slot is only valid if its generation is the one of its key, so the value of a
+ * deleted and then recreated key is NULL in every thread without visiting them.
+ */
+struct thread_key
+{
+    int in_use;
+    unsigned long generation;
+    void (*destructor)(void *);
+};
+
+struct thread_specific
+{
+    unsigned long generation;
+    void *value;
+};
+
+/* Future of thread_async: the thread computing it is only given a stack when it is
+ * dispatched, so a future awaited before it has started runs inline in the awaiting thread.
+ */
+typedef enum future_state
+{
+    FUTURE_WAITING,  // continuation of thread_future_then, its parent isn't done yet
+    FUTURE_READY,    // in the tree, not started
+    FUTURE_RUNNING,
+    FUTURE_DONE
+} future_state;
+
+struct thread_future
+{
+    int state; // a future_state, an int for thread_wait_on
+    void *retval;
+    struct thread_struct *thread;         // computes the future, freed with it
+    struct thread_future *continuation;   // started with retval when the future is done
+    struct thread_future *parent;         // freed when the continuation starts
+};
+
+/* Run stack of the USE_SHARED_STACK mode, used by the threads whose id is its index modulo
+ * SHARED_STACKS. A thread leaves its frames on it when it is switched out, they are only copied
+ * out to a buffer of the thread when another thread needs the stack, and copied back before it runs.
+ */
+struct shared_stack
+{
+    char *base;
+    struct thread_struct *owner; // thread whose frames are on the stack, NULL if none
+};
+
+/* Fork-join tasks: a task is only a closure given by the caller, queued until the thread
+ * syncing it runs it inline, or until a worker thread picks it when the others yield or block.
+ */
+typedef enum task_state
+{
+    TASK_PENDING, // in the queue of pending tasks
+    TASK_RUNNING,
+    TASK_DONE
+} task_state;
+
+typedef enum task_worker_state
+{
+    TASK_WORKER_NONE, // not a task worker
+    TASK_WORKER_IDLE,
+    TASK_WORKER_BUSY, // running a task
+    TASK_WORKER_BLOCKED // blocked in the task it runs, counted in nb_blocked_task_workers
+} task_worker_state;
+
+/* Thread pool: the submitted jobs wait in a ring of queue_size slots. the threads waiting
+ * for something in the pool are blocked on the address of the counter telling how many they are,
+ * so nobody is woken (nor hashed) when nobody waits.
+ */
+struct thread_pool_job
+{
+    void (*func)(void *);
+    void *arg;
+};
+
+struct thread_pool
+{
+    thread_t *workers;
+    int nb_workers;
+    struct thread_pool_job *jobs;
+    int queue_size, head, nb_queued;
+    int nb_unfinished;         // queued or running jobs, thread_pool_wait_all waits on it
+    int nb_idle_workers;       // workers waiting for a job
+    int nb_blocked_submitters; // thread_pool_submit waiting for a free slot
+    int stopping;
+};
+
 struct thread_struct;
 
+/* Threads of a thread_create_many: their descriptors are one array, released when the last
+ * of them is freed. they get their stacks like the others, when they first run.
+ */
+struct thread_batch
+{
+    struct thread_struct *threads;
+    size_t nb_unfreed;
+};
+
+/* Contention profile of a mutex initialized after thread_mutex_profile_start, kept in
+ * mutex_profiles until the end of the program so that destroyed mutexes still appear in the dump.
+ */
+struct mutex_profile
+{
+    struct thread_mutex_profile data;
+    unsigned long long locked_at; // clock ticks of the current acquisition
+    struct mutex_profile *next;
+};
+
+/* Thread handles: a thread_t is the index of the slot of the thread in thread_table in its low
+ * 32 bits, and the generation of the slot in its high 32 bits. Freeing a thread increments the
+ * generation of its slot, so a handle used after thread_join is detected instead of reaching freed
+ * memory, and the slot can be reused. Generations start at 1, so no handle is NULL.
+ */
+struct thread_slot
+{
+    struct thread_struct *thread; // NULL when the slot is free
+    uint32_t generation;
+    uint32_t next_free; // next slot of the free list, when the slot is free
+};
+
 BRTREE_ENTRY_DEF(thread_struct);
 BRTREE_DEF(thread_struct);
 
+/* The descriptors are aligned on cache lines and their fields ordered by use: the first line
+ * holds all that the tree operations and schedule read (a tree walk touches one line per node),
+ * the second one what is updated when the thread is switched, and the rest, the ucontext
+ * included, is only touched by the switch itself or outside the scheduling paths.
+ */
+#define CACHE_LINE_SIZE 64
 typedef struct thread_struct
 {
+    // hot: tree operations and schedule
+    BRTREE_ENTRY(thread_struct)
+    brtree_entry; // the name should always be brtree_entry
+    long long cpu_time_since_reorder;
     thread_state state;
-    int id;
     int priority;
+    int nb_yields_since_reorder;
+    int preempt_depth; // value of preempt_depth when the thread was switched out
+    // warm: switches. scheduling statistics in clock ticks (see thread_getstats)
+    unsigned long long cpu_time, runnable_time, wait_since;
+    unsigned long long nb_voluntary_switches, nb_involuntary_switches;
+    int started; // has run, in its own stack or inline
+    // USE_SHARED_STACK only: the run stack of the thread (NULL on the stack of the main thread),
+    // its stack pointer when switched out and the copy of the live part of its stack
+    struct shared_stack *shared_stack;
+    char *stack_sp;
+    void *saved_stack;
+    size_t saved_size, saved_capacity;
+    // cold
+    int id;
+    thread_t handle; // returned by thread_self, see thread_lookup
     ucontext_t context;
     void *retval;
     int valgrind_stack_id;
-    int nb_yields_since_reorder;
-    long long cpu_time_since_reorder;
-    struct thread_struct *who_is_waiting_for_me, *next_in_mutex_queue;
-    BRTREE_ENTRY(thread_struct)
-    brtree_entry; // the name should always be brtree_entry
-} thread_struct;
+    unsigned long long mutex_blocked_time, join_blocked_time, address_blocked_time, fd_blocked_time;
+    thread_wait_reason wait_reason;
+    int wait_blocker_id; // owner of the mutex or thread joined while blocked, 0 if unknown
+    int fd_events; // events of the descriptor given to thread_wait_fd, set when it is ready, -1 if closed
+    int waited_fd; // descriptor given to thread_wait_fd while blocked in it
+    int park_token; // a thread_wake_external arrived while the thread wasn't parked
+    task_worker_state task_worker;
+    struct thread_struct *who_is_waiting_for_me;
+    struct thread_specific *specific; // THREAD_KEYS_MAX slots, allocated by the first thread_setspecific
+    int *waited_address; // address given to thread_wait_on while blocked in it
+    unsigned long long wait_deadline; // in clock ticks, 0 unless blocked with a timeout (in timed_waiters)
+    struct thread_future *future; // future computed by the thread, NULL for thread_create
+    void *(*start_routine)(void *);
+    void *start_arg;
+    jmp_buf *inline_exit; // set while running inline on the stack of the thread waiting for it
+    struct thread_batch *batch; // NULL if not created by thread_create_many
+    TAILQ_ENTRY(thread_struct) wait_entry; // in a queue of wait_table, or in fd_waiters
+    TAILQ_ENTRY(thread_struct) timeout_entry;
+} __attribute__((aligned(CACHE_LINE_SIZE))) thread_struct;
+
+_Static_assert(offsetof(thread_struct, cpu_time) == CACHE_LINE_SIZE, "the hot fields must fill the first cache line");
+_Static_assert(offsetof(thread_struct, shared_stack) + sizeof(char *) * 2 <= 2 * CACHE_LINE_SIZE,
+               "the fields used by the switches must fit in the second cache line");
 
 static thread_struct *current_thread;
 static int next_id = MAIN_THREAD_ID;
+static int nb_alive_threads = 0; // threads created and not terminated yet
 static unsigned long long start_time = 0;
 static BRTREE(thread_struct) threads = BRTREE_INITIALIZER;
 static thread_struct main_thread_data;
@@ -64,11 +313,122 @@ static thread_struct * main_thread = &main_thread_data;
 static const long long priority_multipliers[40] = { MULTIPLIERS_VALUES };
 static struct sigaction preempt_siga;
 static struct itimerval preempt_timer;
-static int preempt_lock = 0;
+// without preemption, a virtual timer only raises thread_yield_pending, read by thread_should_yield
+static struct sigaction slice_siga;
+static struct itimerval slice_timer;
+static int slice_timer_started = 0;
+volatile int thread_yield_pending = 0;
+// nesting depth of the sections where the preemption is disabled, saved in each thread while it is switched out.
+// a tick arriving in such a section sets preempt_pending, replayed when the depth goes back to 0
+static volatile int preempt_depth = 0;
+static volatile int preempt_pending = 0;
+/* code of the object that defines malloc: the whole C library (memcpy, stdio, the system call
+ * wrappers...), or an allocator loaded before it. the allocator and stdio aren't reentrant and the
+ * internal functions of malloc can't be told apart from the rest, so a tick interrupting any of this
+ * code doesn't switch: preempt_retry_timer brings the next one PREEMPT_RETRY_INTERVAL later, until
+ * one lands outside, and a thread spending its time in the C library is still preempted
+ */
+static uintptr_t allocator_text_start = 0, allocator_text_end = 0;
+static struct itimerval preempt_retry_timer;
+static int preempt_requested = 0;
+static int tsc_is_invariant = 0;
+static int has_rdtscp = 0;
+static double ns_per_tick = 1.0;
+static long long max_ticks_until_reorder = MAX_CPU_TIME_UNTIL_REORDER;
+static struct trace_header *trace_header = NULL;
+static struct trace_event *trace_events;
+static size_t trace_mapping_size;
+static struct thread_key keys[THREAD_KEYS_MAX];
+// copied in the context of each new thread: getcontext is a system call, and when a thread is first
+// dispatched from the preemption handler, it would capture a signal mask blocking SIGALRM
+static ucontext_t initial_context;
+static void *stack_cache[STACK_CACHE_SIZE];
+static int nb_cached_stacks = 0;
+// terminated thread whose stack is released by the next thread to run, once it is not used anymore
+static struct thread_struct *exited_thread = NULL;
+static struct shared_stack shared_stacks[SHARED_STACKS];
+// runs shared_stack_switcher, which copies the stacks when switching to switching_to
+static ucontext_t switcher_context;
+static struct thread_struct *switching_to;
+// threads blocked in thread_wait_on, hashed by address. the threads waiting on different
+// addresses of the same bucket share its queue, each one in the order of its calls
+static TAILQ_HEAD(wait_queue, thread_struct) wait_table[WAIT_TABLE_SIZE];
+// threads blocked with a timeout, by increasing deadline, expired by schedule
+static TAILQ_HEAD(timeout_queue, thread_struct) timed_waiters = TAILQ_HEAD_INITIALIZER(timed_waiters);
+// pending tasks, the newest at the head: a thread syncs the last tasks it spawned,
+// the workers take the oldest ones, usually the biggest of a divide and conquer
+static thread_task_t *pending_tasks_head = NULL, *pending_tasks_tail = NULL;
+static int task_workers_started = 0;
+static int nb_idle_workers = 0; // workers blocked on &nb_idle_workers
+static int nb_task_workers = 0;
+static int nb_blocked_task_workers = 0; // a task blocked on another one still pending would wait forever
+// reallocated when full: only read with the preemption locked, so that no thread can be using it
+static struct thread_slot *thread_table = NULL;
+static uint32_t thread_table_size = 0;
+static uint32_t thread_table_used = 0; // slots given at least once, the others are all free
+static uint32_t thread_table_free = UINT32_MAX; // head of the free list of the reused slots
+// threads blocked in thread_wait_fd are registered in epoll_fd, created by the first one
+static int epoll_fd = -1;
+static int nb_fd_waiters = 0;
+static unsigned long long last_fd_poll = 0; // in clock ticks
+// epoll silently forgets a descriptor once closed: its waiter is only woken by check_closed_fds
+static TAILQ_HEAD(fd_queue, thread_struct) fd_waiters = TAILQ_HEAD_INITIALIZER(fd_waiters);
+static unsigned long long last_fd_check = 0; // in clock ticks
+/* thread_wake_external can be called from any kernel thread: it pushes the handle on a lock-free
+ * stack and kicks external_fd, an eventfd registered in epoll_fd by the first thread_park. the
+ * scheduler drains the stack at each call and when it wakes up from epoll
+ */
+struct external_wake
+{
+    thread_t thread;
+    struct external_wake *next;
+};
+static struct external_wake *external_wakes = NULL; // newest first
+static int external_fd = -1;
+static int external_kicked = 0; // external_fd has been written since the scheduler last read it
+static int external_registered = 0;
+static int nb_parked = 0;
+static int mutex_profile_enabled = 0;
+static struct mutex_profile *mutex_profiles = NULL;
+static long mutex_profile_exit_dump = -1; // LIBTHREAD_MUTEX_PROFILE: number of mutexes dumped at exit, -1 without
+
+static int thread_slot_alloc(thread_struct *thread);
+static void thread_free(thread_struct *thread);
+static void future_started(struct thread_future *future);
+static void release_exited_stack(void);
+static int shared_stack_init(void);
+static void preempt_replay(void);
+static int schedule(void);
+static void task_worker_blocked(void);
+static void thread_switch_to(thread_struct *next_thread, int is_preempted, unsigned long long end_time);
+static void yield_to_locked(thread_struct *target);
+static void expire_timeouts(unsigned long long now);
+static void wait_idle(void);
+static void poll_fds(const struct timespec *timeout);
+static void check_closed_fds(void);
+static void report_deadlock(void);
+static void drain_external_wakes(void);
+static void future_done(struct thread_future *future, void *retval);
 
-#define PREEMPT_LOCK preempt_lock = 1
-#define PREEMPT_UNLOCK preempt_lock = 0
-#define PREEMPT_IS_LOCKED (preempt_lock == 1)
+// the compiler barriers keep the accesses to the scheduler structures inside the section
+#define PREEMPT_LOCK \
+    do { \
+        preempt_depth++; \
+        __asm__ __volatile__("" ::: "memory"); \
+    } while (0)
+#define PREEMPT_UNLOCK \
+    do { \
+        __asm__ __volatile__("" ::: "memory"); \
+        if (--preempt_depth == 0 && preempt_pending) \
+            preempt_replay(); \
+    } while (0)
+#define PREEMPT_IS_LOCKED (preempt_depth > 0)
+
+// Records a trace event when tracing is enabled, to be used with the preemption locked
+#define TRACE(type, thread, arg, reason) \
+    do { \
+        if (trace_header != NULL) trace_record(type, thread, arg, reason); \
+    } while (0)
 
 // Inline assembly to read the Time Stamp Counter (TSC)
 
@@ -77,77 +437,365 @@ uint64_t rdtsc(){
     __asm__ __volatile__ ("rdtsc" : "=a" (lo), "=d" (hi));
     return ((uint64_t)hi << 32) | lo;
 }
+
+// Same as rdtsc, but waits for the previous instructions to complete before reading the counter
+static uint64_t rdtsc_ordered(){
+    unsigned int lo,hi,aux;
+    if (has_rdtscp) {
+        __asm__ __volatile__ ("rdtscp" : "=a" (lo), "=d" (hi), "=c" (aux));
+    } else {
+        __asm__ __volatile__ ("lfence\n\trdtsc" : "=a" (lo), "=d" (hi) :: "memory");
+    }
+    return ((uint64_t)hi << 32) | lo;
+}
+
+static unsigned long long monotonic_ns()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+/* Scheduler clock, in ticks: TSC cycles when the TSC is invariant (constant rate, doesn't
+ * stop in deep C-states), nanoseconds from the vDSO clock_gettime otherwise.
+ */
+static inline unsigned long long clock_ticks()
+{
+    return tsc_is_invariant ? rdtsc() : monotonic_ns();
+}
+
+static inline unsigned long long clock_ticks_ordered()
+{
+    return tsc_is_invariant ? rdtsc_ordered() : monotonic_ns();
+}
+
+static unsigned long long ticks_to_ns(unsigned long long ticks)
+{
+    return (unsigned long long)(ticks * ns_per_tick);
+}
+
+static unsigned long long ns_to_ticks(unsigned long long ns)
+{
+    return (unsigned long long)(ns / ns_per_tick);
+}
+
+// the clock in timeout_ns from now, saturated instead of wrapping around for huge timeouts
+static unsigned long long deadline_after(unsigned long long timeout_ns)
+{
+    unsigned long long now = clock_ticks();
+    double ticks = timeout_ns / ns_per_tick;
+    return ticks < (double)(ULLONG_MAX - now) ? now + (unsigned long long)ticks : ULLONG_MAX;
+}
+
+// Detects an invariant TSC and computes its frequency, from CPUID or by measuring it against clock_gettime
+static void calibrate_clock()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (__get_cpuid(0x80000001, &eax, &ebx, &ecx, &edx))
+        has_rdtscp = (edx >> 27) & 1;
+    if (__get_cpuid(0x80000007, &eax, &ebx, &ecx, &edx))
+        tsc_is_invariant = (edx >> 8) & 1;
+
+    if (tsc_is_invariant) {
+        // Leaf 0x15 gives TSC frequency = crystal frequency * ebx / eax, when the crystal frequency is known
+        if (__get_cpuid_max(0, NULL) >= 0x15 && __get_cpuid(0x15, &eax, &ebx, &ecx, &edx) && eax != 0 && ebx != 0 && ecx != 0) {
+            ns_per_tick = 1e9 * eax / ((double)ecx * ebx);
+        } else {
+            unsigned long long start_ns = monotonic_ns(), start_tsc = rdtsc_ordered();
+            unsigned long long end_ns, end_tsc;
+            do {
+                end_ns = monotonic_ns();
+                end_tsc = rdtsc_ordered();
+            } while (end_ns - start_ns < CALIBRATION_TIME);
+            ns_per_tick = (double)(end_ns - start_ns) / (end_tsc - start_tsc);
+        }
+    }
+    max_ticks_until_reorder = ns_to_ticks(MAX_CPU_TIME_UNTIL_REORDER);
+}
     
-static void preempt_handler(int) { 
-    if (!PREEMPT_IS_LOCKED) { 
+static void preempt_handler(int sig, siginfo_t *info, void *context) {
+    (void)info;
+    // the threads of the library run on the initial kernel thread, whose id is the pid. the tick
+    // is sent to the process, and may be delivered to a kernel thread of another library
+    if (gettid() != getpid()) {
+        tgkill(getpid(), getpid(), sig);
+        return;
+    }
+    uintptr_t pc = ((ucontext_t *)context)->uc_mcontext.gregs[REG_RIP];
+    if (PREEMPT_IS_LOCKED) {
+        preempt_pending = 1;
+    } else if (pc >= allocator_text_start && pc < allocator_text_end) {
+        setitimer(ITIMER_REAL, &preempt_retry_timer, NULL);
+    } else {
+        preempt_requested = 1;
         thread_yield();
     }
 }
 
+// finds the executable segment of the object containing the address given in data
+static int find_allocator_text(struct dl_phdr_info *info, size_t size, void *data)
+{
+    uintptr_t address = (uintptr_t)data;
+    int i;
+    (void)size;
+    for (i = 0; i < info->dlpi_phnum; i++) {
+        const ElfW(Phdr) *phdr = &info->dlpi_phdr[i];
+        uintptr_t start = info->dlpi_addr + phdr->p_vaddr;
+        if (phdr->p_type == PT_LOAD && (phdr->p_flags & PF_X) && address >= start && address < start + phdr->p_memsz) {
+            allocator_text_start = start;
+            allocator_text_end = start + phdr->p_memsz;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// the preemption that was deferred by PREEMPT_LOCK, when the section is left
+static void preempt_replay(void)
+{
+    preempt_pending = 0;
+    preempt_requested = 1;
+    thread_yield();
+}
+
+static void slice_handler(int)
+{
+    thread_yield_pending = 1;
+}
+
+// starts the slice timer when there are other threads to give the cpu to, without preemption.
+// SA_RESTART and a timer of cpu time, which only expires in user code, keep system calls unaffected
+static void slice_timer_start(void)
+{
+    if (USE_PREEMPTION || slice_timer_started)
+        return;
+    slice_timer_started = 1;
+    slice_siga.sa_handler = slice_handler;
+    sigemptyset(&slice_siga.sa_mask);
+    slice_siga.sa_flags = SA_RESTART;
+    sigaction(SIGVTALRM, &slice_siga, NULL);
+    slice_timer.it_value.tv_sec = 0;
+    slice_timer.it_value.tv_usec = SLICE_TIME_INTERVAL;
+    slice_timer.it_interval = slice_timer.it_value;
+    setitimer(ITIMER_VIRTUAL, &slice_timer, NULL);
+}
+
+static void init_stats(thread_struct *thread)
+{
+    thread->cpu_time = 0;
+    thread->runnable_time = 0;
+    thread->mutex_blocked_time = 0;
+    thread->join_blocked_time = 0;
+    thread->address_blocked_time = 0;
+    thread->fd_blocked_time = 0;
+    thread->nb_voluntary_switches = 0;
+    thread->nb_involuntary_switches = 0;
+    thread->wait_since = clock_ticks();
+    thread->wait_reason = WAIT_RUNNABLE;
+}
+
+static void trace_record(trace_event_type type, int thread, int arg, int reason)
+{
+    struct trace_event *event = &trace_events[trace_header->head % trace_header->nb_events];
+    event->ticks = clock_ticks();
+    event->type = type;
+    event->thread = thread;
+    event->arg = arg;
+    event->reason = reason;
+    trace_header->head++;
+}
+
+// Charges the time spent blocked to the right counter, the thread is now waiting for the cpu
+static void stats_wake(thread_struct *thread)
+{
+    TRACE(TRACE_WAKE, current_thread->id, thread->id, thread->wait_reason);
+    unsigned long long now = clock_ticks();
+    if (thread->wait_reason == WAIT_MUTEX)
+        thread->mutex_blocked_time += now - thread->wait_since;
+    else if (thread->wait_reason == WAIT_JOIN)
+        thread->join_blocked_time += now - thread->wait_since;
+    else if (thread->wait_reason == WAIT_ADDRESS || thread->wait_reason == WAIT_PARK)
+        thread->address_blocked_time += now - thread->wait_since;
+    else if (thread->wait_reason == WAIT_FD)
+        thread->fd_blocked_time += now - thread->wait_since;
+    thread->wait_reason = WAIT_RUNNABLE;
+    if (thread->task_worker == TASK_WORKER_BLOCKED) {
+        thread->task_worker = TASK_WORKER_BUSY;
+        nb_blocked_task_workers--;
+    }
+    thread->wait_since = now;
+}
+
 __attribute__((constructor)) void init()
 {
+    int i;
+    calibrate_clock();
+    if (thread_slot_alloc(main_thread) == -1) {
+        perror("init: table des threads");
+        exit(EXIT_FAILURE);
+    }
     main_thread->id = next_id++;
+    nb_alive_threads++;
     main_thread->priority = 20;
     main_thread->state = READY;
     main_thread->retval = NULL;
     main_thread->nb_yields_since_reorder = 0;
     main_thread->cpu_time_since_reorder = 0;
     main_thread->who_is_waiting_for_me = NULL;
-    main_thread->next_in_mutex_queue = NULL;
+    main_thread->specific = NULL;
+    main_thread->waited_address = NULL;
+    main_thread->wait_blocker_id = 0;
+    main_thread->park_token = 0;
+    main_thread->task_worker = TASK_WORKER_NONE;
+    main_thread->wait_deadline = 0;
+    main_thread->future = NULL;
+    main_thread->started = 1;
+    main_thread->inline_exit = NULL;
+    main_thread->batch = NULL;
+    main_thread->shared_stack = NULL;
+    main_thread->saved_stack = NULL;
+    init_stats(main_thread);
     main_thread->context.uc_stack.ss_sp = NULL;
     main_thread->valgrind_stack_id = VALGRIND_STACK_REGISTER(main_thread->context.uc_stack.ss_sp, main_thread->context.uc_stack.ss_sp + STACK_SIZE);
     getcontext(&main_thread->context);
+    getcontext(&initial_context);
+    initial_context.uc_link = NULL;
+    initial_context.uc_stack.ss_size = STACK_SIZE;
+    if (USE_SHARED_STACK && shared_stack_init() == -1) {
+        perror("init: allocation des piles partagées");
+        exit(EXIT_FAILURE);
+    }
     BRTREE_ENTRY_INITIALIZE(main_thread, 0);
     BRTREE_INSERT(main_thread, &threads, thread_struct);
+    for (i = 0; i < WAIT_TABLE_SIZE; i++)
+        TAILQ_INIT(&wait_table[i]);
+
+    start_time = clock_ticks();
 
     // Initialisation de la préemption
-    preempt_siga.sa_handler = preempt_handler;
+    if (USE_PREEMPTION)
+        dl_iterate_phdr(find_allocator_text, (void *)(uintptr_t)&malloc);
+    preempt_siga.sa_sigaction = preempt_handler;
     sigemptyset(&preempt_siga.sa_mask);
-    preempt_siga.sa_flags = 0;
+    preempt_siga.sa_flags = SA_SIGINFO;
     sigaction(SIGALRM, &preempt_siga, NULL);
 
     preempt_timer.it_value.tv_sec = 0;
     preempt_timer.it_value.tv_usec = PREEMPT_TIME_INTERVAL;
     preempt_timer.it_interval = preempt_timer.it_value;
+    preempt_retry_timer.it_value.tv_sec = 0;
+    preempt_retry_timer.it_value.tv_usec = PREEMPT_RETRY_INTERVAL;
+    preempt_retry_timer.it_interval = preempt_timer.it_interval;
 
     current_thread = main_thread;
     if(USE_PREEMPTION) setitimer(ITIMER_REAL, &preempt_timer, NULL);
+
+    const char *trace_path = getenv("LIBTHREAD_TRACE");
+    if (trace_path != NULL) {
+        const char *nb_events = getenv("LIBTHREAD_TRACE_EVENTS");
+        thread_trace_start(trace_path, nb_events != NULL ? strtoul(nb_events, NULL, 10) : 0);
+    }
+    const char *mutex_profile = getenv("LIBTHREAD_MUTEX_PROFILE");
+    if (mutex_profile != NULL) {
+        mutex_profile_exit_dump = strtoul(mutex_profile, NULL, 10);
+        thread_mutex_profile_start();
+    }
 }
 
 __attribute__((destructor)) void destroy()
 {
-    if (main_thread->who_is_waiting_for_me != NULL)
-    {
-        free(main_thread->who_is_waiting_for_me->context.uc_stack.ss_sp);
-        free(main_thread->who_is_waiting_for_me);
+    thread_trace_stop();
+    if (mutex_profile_exit_dump >= 0)
+        thread_mutex_profile_dump(NULL, mutex_profile_exit_dump);
+    while (mutex_profiles != NULL) {
+        struct mutex_profile *profile = mutex_profiles;
+        mutex_profiles = profile->next;
+        free((char *)profile->data.name);
+        free(profile);
     }
+    // the last thread, when main has called thread_exit: it may be part of a thread_create_many
+    if (main_thread->who_is_waiting_for_me != NULL)
+        thread_free(main_thread->who_is_waiting_for_me);
 }
 
 /* recuperer l'identifiant du thread courant.
  */
 extern thread_t thread_self(void)
 {
-    return current_thread;
+    return current_thread->handle;
 }
 
 void thread_function_wrapper(void *(*function)(void *), void *arg)
 {
-    start_time = rdtsc();
+    start_time = clock_ticks();
+    current_thread->runnable_time += start_time - current_thread->wait_since;
+    current_thread->started = 1;
+    release_exited_stack();
+    if (current_thread->future != NULL)
+        future_started(current_thread->future);
+    preempt_depth = 1; // dispatched by schedule, the section of which ends here
     PREEMPT_UNLOCK;
     thread_exit(function(arg));
 }
 
-/* creer un nouveau thread qui va exécuter la fonction func avec l'argument funcarg.
- * renvoie 0 en cas de succès, -1 en cas d'erreur.
- */
-extern int thread_create(thread_t *newthread, void *(*func)(void *), void *funcarg)
+// gives a slot of thread_table, and so a handle, to the thread. returns -1 without memory
+static int thread_slot_alloc(thread_struct *thread)
 {
-    // Allocation de la structure du thread
-    thread_struct *new_thread = malloc(sizeof(thread_struct));
-    if (new_thread == NULL)
-        return -1;
+    uint32_t index;
+    PREEMPT_LOCK;
+    if (thread_table_free != UINT32_MAX) {
+        index = thread_table_free;
+        thread_table_free = thread_table[index].next_free;
+    } else {
+        if (thread_table_used == thread_table_size) {
+            uint32_t size = thread_table_size == 0 ? THREAD_TABLE_INITIAL_SIZE : 2 * thread_table_size;
+            struct thread_slot *table = realloc(thread_table, size * sizeof(struct thread_slot));
+            if (table == NULL) {
+                PREEMPT_UNLOCK;
+                return -1;
+            }
+            thread_table = table;
+            thread_table_size = size;
+        }
+        index = thread_table_used++;
+        thread_table[index].generation = 1;
+    }
+    thread_table[index].thread = thread;
+    thread->handle = (thread_t)((uintptr_t)thread_table[index].generation << 32 | index);
+    PREEMPT_UNLOCK;
+    return 0;
+}
+
+// makes the handle of the thread stale and its slot reusable
+static void thread_slot_release(thread_struct *thread)
+{
+    uint32_t index = (uint32_t)(uintptr_t)thread->handle;
+    PREEMPT_LOCK;
+    thread_table[index].thread = NULL;
+    // generation 0 is skipped on wraparound, so that a handle is never NULL
+    if (++thread_table[index].generation == 0)
+        thread_table[index].generation = 1;
+    thread_table[index].next_free = thread_table_free;
+    thread_table_free = index;
+    PREEMPT_UNLOCK;
+}
+
+// the thread of a handle, NULL if the handle isn't one or if its thread has been freed.
+// to be called with the preemption locked
+static inline thread_struct *thread_lookup(thread_t handle)
+{
+    uint32_t index = (uint32_t)(uintptr_t)handle, generation = (uintptr_t)handle >> 32;
+    if (index >= thread_table_used || thread_table[index].generation != generation)
+        return NULL;
+    return thread_table[index].thread;
+}
 
-    // Initialisation de la structure du thread
+// initializes a thread structure, without stack and outside of the tree.
+// returns -1 if it can't get a handle
+static int thread_init(thread_struct *new_thread, void *(*func)(void *), void *funcarg)
+{
+    if (thread_slot_alloc(new_thread) == -1)
+        return -1;
     new_thread->id = next_id++;
     new_thread->priority = 20;
     new_thread->state = READY;
@@ -155,31 +803,247 @@ extern int thread_create(thread_t *newthread, void *(*func)(void *), void *funca
     new_thread->cpu_time_since_reorder = 0;
     new_thread->retval = NULL;
     new_thread->who_is_waiting_for_me = NULL;
-    new_thread->next_in_mutex_queue = NULL;
-
-    // Gestion du contexte et de la pile du thread créé
-    new_thread->context.uc_stack.ss_sp = malloc(STACK_SIZE);
-    new_thread->context.uc_stack.ss_size = STACK_SIZE;
-    new_thread->valgrind_stack_id = VALGRIND_STACK_REGISTER(new_thread->context.uc_stack.ss_sp, new_thread->context.uc_stack.ss_sp + STACK_SIZE);
-    new_thread->context.uc_link = NULL;
-    getcontext(&new_thread->context); // recupere le contexte actuel
+    new_thread->specific = NULL;
+    new_thread->waited_address = NULL;
+    new_thread->wait_blocker_id = 0;
+    new_thread->park_token = 0;
+    new_thread->task_worker = TASK_WORKER_NONE;
+    new_thread->wait_deadline = 0;
+    new_thread->future = NULL;
+    new_thread->start_routine = func;
+    new_thread->start_arg = funcarg;
+    new_thread->started = 0;
+    new_thread->inline_exit = NULL;
+    new_thread->batch = NULL;
+    new_thread->shared_stack = NULL;
+    new_thread->saved_stack = NULL;
+    new_thread->saved_size = 0;
+    new_thread->saved_capacity = 0;
+    new_thread->context.uc_stack.ss_sp = NULL;
+    init_stats(new_thread);
+    return 0;
+}
 
-    if (new_thread->context.uc_stack.ss_sp == NULL)
-    {
+static thread_struct *thread_new(void *(*func)(void *), void *funcarg)
+{
+    thread_struct *new_thread = aligned_alloc(CACHE_LINE_SIZE, sizeof(thread_struct));
+    if (new_thread == NULL)
+        return NULL;
+    if (thread_init(new_thread, func, funcarg) == -1) {
         free(new_thread);
+        return NULL;
+    }
+    return new_thread;
+}
+
+// gives a stack, from the cache if possible, and its initial context to a thread.
+// returns -1 if the stack can't be allocated, to be called with the preemption locked
+static int thread_allocate_stack(thread_struct *thread)
+{
+    if (USE_SHARED_STACK) {
+        // the context is made by shared_stack_switcher, once the frames of the owner are saved
+        thread->shared_stack = &shared_stacks[thread->id % SHARED_STACKS];
+        thread->context = initial_context;
+        thread->context.uc_stack.ss_sp = thread->shared_stack->base;
+        return 0;
+    }
+    void *stack = nb_cached_stacks > 0 ? stack_cache[--nb_cached_stacks] : malloc(STACK_SIZE);
+    if (stack == NULL)
+        return -1;
+    thread->context = initial_context;
+    thread->context.uc_stack.ss_sp = stack;
+    thread->valgrind_stack_id = VALGRIND_STACK_REGISTER(stack, stack + STACK_SIZE);
+    makecontext(&thread->context, (void (*)(void))thread_function_wrapper, 2, thread->start_routine, thread->start_arg);
+    return 0;
+}
+
+// gives the stack of the thread that has just terminated back to the cache, to be called
+// with the preemption locked by a thread that has just been switched to
+static void release_exited_stack(void)
+{
+    if (exited_thread == NULL)
+        return;
+    if (exited_thread->shared_stack != NULL) {
+        if (exited_thread->shared_stack->owner == exited_thread)
+            exited_thread->shared_stack->owner = NULL;
+        free(exited_thread->saved_stack);
+        exited_thread->saved_stack = NULL;
+        exited_thread->saved_capacity = 0;
+        exited_thread->context.uc_stack.ss_sp = NULL;
+        exited_thread = NULL;
+        return;
+    }
+    void *stack = exited_thread->context.uc_stack.ss_sp;
+    VALGRIND_STACK_DEREGISTER(exited_thread->valgrind_stack_id);
+    exited_thread->context.uc_stack.ss_sp = NULL;
+    exited_thread = NULL;
+    if (nb_cached_stacks < STACK_CACHE_SIZE)
+        stack_cache[nb_cached_stacks++] = stack;
+    else
+        free(stack);
+}
+
+// copies the frames of the owner of the run stack of switching_to out, and the ones of switching_to
+// back, then switches to it. loops forever on its own stack, resumed by thread_switch
+static void shared_stack_switcher(void)
+{
+    while (1) {
+        thread_struct *next = switching_to;
+        struct shared_stack *stack = next->shared_stack;
+        thread_struct *owner = stack->owner;
+        char *top = stack->base + STACK_SIZE;
+        // the frames of a terminated thread are dropped
+        if (owner != NULL && owner->state != TERMINATED) {
+            size_t size = top - owner->stack_sp;
+            if (size > owner->saved_capacity) {
+                void *saved_stack = realloc(owner->saved_stack, size);
+                if (saved_stack == NULL) {
+                    perror("thread_yield: sauvegarde de la pile");
+                    exit(EXIT_FAILURE);
+                }
+                owner->saved_stack = saved_stack;
+                owner->saved_capacity = size;
+            }
+            memcpy(owner->saved_stack, owner->stack_sp, size);
+            owner->saved_size = size;
+        }
+        stack->owner = next;
+        if (next->started)
+            memcpy(top - next->saved_size, next->saved_stack, next->saved_size);
+        else
+            makecontext(&next->context, (void (*)(void))thread_function_wrapper, 2, next->start_routine, next->start_arg);
+        swapcontext(&switcher_context, &next->context);
+    }
+}
+
+// allocates the run stacks and the stack of the switcher, returns -1 on failure
+static int shared_stack_init(void)
+{
+    int i;
+    for (i = 0; i < SHARED_STACKS; i++) {
+        shared_stacks[i].base = malloc(STACK_SIZE);
+        if (shared_stacks[i].base == NULL)
+            return -1;
+        VALGRIND_STACK_REGISTER(shared_stacks[i].base, shared_stacks[i].base + STACK_SIZE);
+        shared_stacks[i].owner = NULL;
+    }
+    switcher_context = initial_context;
+    switcher_context.uc_stack.ss_sp = malloc(SWITCHER_STACK_SIZE);
+    if (switcher_context.uc_stack.ss_sp == NULL)
         return -1;
+    switcher_context.uc_stack.ss_size = SWITCHER_STACK_SIZE;
+    VALGRIND_STACK_REGISTER(switcher_context.uc_stack.ss_sp, switcher_context.uc_stack.ss_sp + SWITCHER_STACK_SIZE);
+    makecontext(&switcher_context, shared_stack_switcher, 0);
+    return 0;
+}
+
+// switches from save_thread to next, to be called with the preemption locked. with USE_SHARED_STACK,
+// goes through the switcher when the frames of next are not on its run stack
+static void thread_switch(thread_struct *save_thread, thread_struct *next)
+{
+    save_thread->preempt_depth = preempt_depth;
+    if (USE_SHARED_STACK) {
+        // the live part of the stack is above the stack pointer of this frame,
+        // swapcontext only saves the registers
+        char *sp;
+        __asm__ __volatile__("mov %%rsp, %0" : "=r"(sp));
+        save_thread->stack_sp = sp;
+    }
+    if (USE_SHARED_STACK && next->shared_stack != NULL && next->shared_stack->owner != next) {
+        switching_to = next;
+        swapcontext(&save_thread->context, &switcher_context);
+    } else {
+        swapcontext(&save_thread->context, &next->context);
+    }
+    preempt_depth = save_thread->preempt_depth;
+}
+
+static void thread_free(thread_struct *thread)
+{
+    struct thread_batch *batch = thread->batch;
+    thread_slot_release(thread);
+    free(thread->saved_stack);
+    if (thread->shared_stack == NULL && thread->context.uc_stack.ss_sp != NULL) {
+        VALGRIND_STACK_DEREGISTER(thread->valgrind_stack_id);
+        free(thread->context.uc_stack.ss_sp);
     }
-    makecontext(&new_thread->context, (void (*)(void))thread_function_wrapper, 2, func, funcarg);
+    if (batch == NULL)
+        free(thread);
+    // atomic so that a preemption can't lose a decrement
+    else if (__atomic_sub_fetch(&batch->nb_unfreed, 1, __ATOMIC_RELAXED) == 0) {
+        free(batch->threads);
+        free(batch);
+    }
+}
+
+// inserts a new thread in the tree, to be called with the preemption locked
+static void thread_make_runnable(thread_struct *thread)
+{
+    // the new thread starts at the smallest key of the tree: starting at 0 would let it
+    // run until it has consumed as much cpu time as its creator since the beginning
+    long long min_key = 0;
+    if (!BRTREE_EMPTY(&threads)) {
+        thread_struct *min_thread;
+        BRTREE_GET_SMALLER_KEY(&threads, min_thread);
+        min_key = BRTREE_KEY(min_thread);
+    }
+    BRTREE_ENTRY_INITIALIZE(thread, min_key);
+    BRTREE_INSERT(thread, &threads, thread_struct);
+    nb_alive_threads++;
+    slice_timer_start();
+    TRACE(TRACE_CREATE, current_thread->id, thread->id, 0);
+}
+
+/* runs a thread that has not started yet on the stack of the current thread, which waits
+ * for it (it must already be out of the tree, with who_is_waiting_for_me set).
+ * the thread really becomes the current one: if it blocks, its context is saved on this stack,
+ * that can't be used by anybody else until it terminates. thread_exit then comes back here
+ * with a longjmp. to be called with the preemption locked, returns with it locked.
+ */
+static void thread_run_inline(thread_struct *thread)
+{
+    jmp_buf inline_exit;
+    thread_struct *waiting_thread = current_thread;
+    unsigned long long now = clock_ticks();
+
+    waiting_thread->cpu_time += now - start_time;
+    waiting_thread->cpu_time_since_reorder += now - start_time;
+    waiting_thread->wait_since = now;
+    start_time = now;
+    thread->runnable_time += now - thread->wait_since;
+    thread->started = 1;
+    thread->inline_exit = &inline_exit;
+    // the frames of the waiting thread are part of the live stack of the inline thread
+    thread->shared_stack = waiting_thread->shared_stack;
+    if (thread->shared_stack != NULL)
+        thread->shared_stack->owner = thread;
+    TRACE(TRACE_SWITCH, waiting_thread->id, thread->id, 0);
+    current_thread = thread;
+    if (thread->future != NULL)
+        future_started(thread->future);
 
-    *newthread = new_thread;
+    if (setjmp(inline_exit) == 0) {
+        PREEMPT_UNLOCK;
+        thread_exit(thread->start_routine(thread->start_arg));
+    }
+}
 
-    // Ajout du thread à la liste des threads
-    BRTREE_ENTRY_INITIALIZE(new_thread, 0);
+/* creer un nouveau thread qui va exécuter la fonction func avec l'argument funcarg.
+ * renvoie 0 en cas de succès, -1 en cas d'erreur.
+ * le thread ne reçoit sa pile que quand il est ordonnancé pour la première fois, et la rend
+ * dès qu'il se termine. avec USE_LAZY_THREADS, s'il est joint avant d'avoir démarré, il
+ * s'exécute directement sur la pile du thread qui le joint.
+ */
+extern int thread_create(thread_t *newthread, void *(*func)(void *), void *funcarg)
+{
+    thread_struct *new_thread = thread_new(func, funcarg);
+    if (new_thread == NULL)
+        return -1;
+    *newthread = new_thread->handle;
 
     PREEMPT_LOCK;
-    BRTREE_INSERT(new_thread, &threads, thread_struct);
+    thread_make_runnable(new_thread);
     PREEMPT_UNLOCK;
-
     return 0;
 }
 
@@ -190,8 +1054,63 @@ static int last_yield() {
         main_thread->who_is_waiting_for_me = current_thread;
         thread_struct *save_thread = current_thread;
         current_thread = next_thread;
-        swapcontext(&save_thread->context, &current_thread->context);
+        thread_switch(save_thread, current_thread);
+        release_exited_stack();
+    }
+    return 0;
+}
+
+/* créer n threads d'un coup, avec un seul bloc de descripteurs et une seule insertion dans l'arbre.
+ * renvoie 0 en cas de succès, -1 en cas d'erreur.
+ */
+extern int thread_create_many(thread_t *newthreads, size_t n, void *(*func)(void *), void *args[], const thread_attr_t *attr)
+{
+    struct thread_batch *batch;
+    size_t i;
+    int priority = attr != NULL ? attr->priority : 20;
+
+    if (newthreads == NULL || func == NULL || priority < 0 || priority > 39)
+        return -1;
+    if (n == 0)
+        return 0;
+    batch = malloc(sizeof(struct thread_batch));
+    if (batch == NULL)
+        return -1;
+    batch->threads = aligned_alloc(CACHE_LINE_SIZE, n * sizeof(thread_struct));
+    if (batch->threads == NULL) {
+        free(batch);
+        return -1;
+    }
+    batch->nb_unfreed = n;
+
+    for (i = 0; i < n; i++) {
+        thread_struct *thread = &batch->threads[i];
+        if (thread_init(thread, func, args != NULL ? args[i] : NULL) == -1) {
+            while (i > 0)
+                thread_slot_release(&batch->threads[--i]);
+            free(batch->threads);
+            free(batch);
+            return -1;
+        }
+        thread->priority = priority;
+        thread->batch = batch;
+        newthreads[i] = thread->handle;
     }
+
+    PREEMPT_LOCK;
+    long long min_key = 0;
+    if (!BRTREE_EMPTY(&threads)) {
+        thread_struct *min_thread;
+        BRTREE_GET_SMALLER_KEY(&threads, min_thread);
+        min_key = BRTREE_KEY(min_thread);
+    }
+    BRTREE_INSERT_MIN_MANY(batch->threads, n, min_key, &threads, thread_struct);
+    nb_alive_threads += n;
+    slice_timer_start();
+    if (trace_header != NULL)
+        for (i = 0; i < n; i++)
+            trace_record(TRACE_CREATE, current_thread->id, batch->threads[i].id, 0);
+    PREEMPT_UNLOCK;
     return 0;
 }
 
@@ -201,20 +1120,46 @@ static int last_yield() {
 extern int thread_yield(void)
 {
     PREEMPT_LOCK;
+    schedule();
+    PREEMPT_UNLOCK;
+    return 0;
+}
+
+// gives the cpu to the thread with the smallest key once the current one has had its share,
+// to be called with the preemption locked, returns with it still locked
+static int schedule(void)
+{
+    int is_preempted = preempt_requested;
+    preempt_requested = 0;
+    if (is_preempted) TRACE(TRACE_PREEMPT, current_thread->id, 0, 0);
+    // the slice of the thread is over, as seen by thread_should_yield
+    int slice_expired = thread_yield_pending;
+    thread_yield_pending = 0;
+
     // Storing cpu time used since last yield
-    unsigned long long end_time = rdtsc();
+    unsigned long long end_time = clock_ticks();
+    current_thread->cpu_time += end_time - start_time;
     current_thread->cpu_time_since_reorder += (BRTREE_KEY(current_thread) == 0 && current_thread->cpu_time_since_reorder == 0 ? 
                                                 1 : (long long)(end_time - start_time));
     current_thread->nb_yields_since_reorder++;
     start_time = end_time;
+    if (!TAILQ_EMPTY(&timed_waiters))
+        expire_timeouts(end_time);
+    if (nb_fd_waiters > 0 && ticks_to_ns(end_time - last_fd_poll) >= FD_POLL_INTERVAL) {
+        struct timespec no_wait = { 0, 0 };
+        poll_fds(&no_wait);
+    }
+    if (__atomic_load_n(&external_wakes, __ATOMIC_RELAXED) != NULL)
+        drain_external_wakes();
 
     // Deciding whether give hand or not
     int is_current_schedulable = BRTREE_IS_IN_TREE(current_thread, &threads);
-    if (current_thread->nb_yields_since_reorder < next_id-1 &&
-        current_thread->cpu_time_since_reorder < MAX_CPU_TIME_UNTIL_REORDER &&
-        is_current_schedulable) 
+    if (!is_current_schedulable && current_thread->task_worker == TASK_WORKER_BUSY)
+        task_worker_blocked();
+    if (current_thread->nb_yields_since_reorder < nb_alive_threads &&
+        current_thread->cpu_time_since_reorder < max_ticks_until_reorder &&
+        is_current_schedulable && !slice_expired) 
     { // if threshold hasn't been exceeded
-        PREEMPT_UNLOCK;
         return 0;
     } else { // if threshold has been exceeded
         BRTREE_KEY(current_thread) += ((current_thread->cpu_time_since_reorder) * priority_multipliers[current_thread->priority]);
@@ -225,39 +1170,128 @@ extern int thread_yield(void)
         }
     }
 
-    if (BRTREE_EMPTY(&threads)) return last_yield();
+    while (BRTREE_EMPTY(&threads) && (!TAILQ_EMPTY(&timed_waiters) || nb_fd_waiters > 0 || nb_parked > 0))
+        wait_idle();
+    if (BRTREE_EMPTY(&threads)) {
+        // the end of the last thread after main has called thread_exit is the end of the process
+        if (main_thread->state != TERMINATED)
+            report_deadlock();
+        return last_yield();
+    }
 
     // Giving hand to thread who has the less cpu time
-    thread_struct *next_thread, *save_thread = current_thread;
+    thread_struct *next_thread;
     BRTREE_GET_SMALLER_KEY(&threads, next_thread);
-    current_thread = next_thread;
-    if (current_thread != save_thread) swapcontext(&save_thread->context, &current_thread->context);
-    start_time = rdtsc();
-    PREEMPT_UNLOCK;
+    thread_switch_to(next_thread, is_preempted, end_time);
     return 0;
 }
 
-/* attendre la fin d'exécution d'un thread.
- * la valeur renvoyée par le thread est placée dans *retval.
- * si retval est NULL, la valeur de retour est ignorée.
+/* passer la main directement au thread donné, s'il est prêt, sans passer par l'ordonnanceur.
+ * le temps consommé est compté au thread courant comme par thread_yield.
+ * si le thread est le thread courant, bloqué ou terminé, équivaut à thread_yield.
+ * renvoie -1 si thread est NULL, ESRCH sans passer la main si le thread a déjà été joint
+ * (thread_lookup ne le retrouve plus), 0 sinon.
  */
-extern int thread_join(thread_t thread, void **retval)
+extern int thread_yield_to(thread_t thread)
 {
-    thread_struct *thread_to_join = (thread_struct *)thread;
-    if (thread_to_join == NULL)
+    if (thread == NULL)
         return -1;
-    
-    thread_struct *tmp = current_thread;
-    while (tmp->who_is_waiting_for_me != NULL && tmp != thread_to_join) tmp = tmp->who_is_waiting_for_me;
-    if (tmp == thread_to_join)
-        return EDEADLK;
-
     PREEMPT_LOCK;
-    if (thread_to_join->state != TERMINATED)
-    {
-        thread_to_join->who_is_waiting_for_me = current_thread;
+    thread_struct *target = thread_lookup(thread);
+    if (target == NULL) {
+        PREEMPT_UNLOCK;
+        return ESRCH;
+    }
+    if (target == current_thread || target->state == TERMINATED || !BRTREE_IS_IN_TREE(target, &threads)) {
+        schedule();
+        PREEMPT_UNLOCK;
+        return 0;
+    }
+    yield_to_locked(target);
+    PREEMPT_UNLOCK;
+    return 0;
+}
+
+// gives the cpu to target, runnable and not the current thread. to be called with the preemption locked
+static void yield_to_locked(thread_struct *target)
+{
+    // same accounting as a thread_yield that reorders, so the target doesn't get the time of the caller
+    unsigned long long end_time = clock_ticks();
+    current_thread->cpu_time += end_time - start_time;
+    current_thread->cpu_time_since_reorder += end_time - start_time;
+    BRTREE_KEY(current_thread) += current_thread->cpu_time_since_reorder * priority_multipliers[current_thread->priority];
+    current_thread->nb_yields_since_reorder = 0;
+    current_thread->cpu_time_since_reorder = 0;
+    if (BRTREE_IS_IN_TREE(current_thread, &threads))
+        BRTREE_REORDER(current_thread, &threads, thread_struct);
+
+    thread_switch_to(target, 0, end_time);
+}
+
+// gives the cpu to next, which is runnable, after the cpu time of the current thread has been
+// accounted until end_time. to be called with the preemption locked
+static void thread_switch_to(thread_struct *next_thread, int is_preempted, unsigned long long end_time)
+{
+    thread_struct *save_thread = current_thread;
+    current_thread = next_thread;
+    if (current_thread != save_thread) {
+        // a new slice for the next thread
+        thread_yield_pending = 0;
+        preempt_pending = 0;
+        if (is_preempted)
+            save_thread->nb_involuntary_switches++;
+        else
+            save_thread->nb_voluntary_switches++;
+        save_thread->wait_since = end_time;
+        TRACE(TRACE_SWITCH, save_thread->id, current_thread->id, 0);
+        // threads only get a stack when they start (the ones started inline have none)
+        if (!current_thread->started && current_thread->context.uc_stack.ss_sp == NULL &&
+            thread_allocate_stack(current_thread) == -1) {
+            perror("thread_yield: allocation de la pile");
+            exit(EXIT_FAILURE);
+        }
+        thread_switch(save_thread, current_thread);
+        release_exited_stack();
+        start_time = clock_ticks();
+        current_thread->runnable_time += start_time - current_thread->wait_since;
+    } else {
+        start_time = clock_ticks();
+    }
+}
+
+/* attendre la fin d'exécution d'un thread.
+ * la valeur renvoyée par le thread est placée dans *retval.
+ * si retval est NULL, la valeur de retour est ignorée.
+ */
+extern int thread_join(thread_t thread, void **retval)
+{
+    if (thread == NULL)
+        return -1;
+    PREEMPT_LOCK;
+    thread_struct *thread_to_join = thread_lookup(thread);
+    if (thread_to_join == NULL) {
+        PREEMPT_UNLOCK;
+        return ESRCH;
+    }
+
+    thread_struct *tmp = current_thread;
+    while (tmp->who_is_waiting_for_me != NULL && tmp != thread_to_join) tmp = tmp->who_is_waiting_for_me;
+    if (tmp == thread_to_join) {
+        PREEMPT_UNLOCK;
+        return EDEADLK;
+    }
+
+    if (thread_to_join->state != TERMINATED)
+    {
+        thread_to_join->who_is_waiting_for_me = current_thread;
+        current_thread->wait_reason = WAIT_JOIN;
+        current_thread->wait_blocker_id = thread_to_join->id;
+        TRACE(TRACE_BLOCK, current_thread->id, thread_to_join->id, WAIT_JOIN);
         BRTREE_ERASE(current_thread, &threads, thread_struct);
-        thread_yield();
+        if (USE_LAZY_THREADS && !thread_to_join->started)
+            thread_run_inline(thread_to_join);
+        else
+            schedule();
     }
     PREEMPT_UNLOCK;
 
@@ -267,12 +1301,52 @@ extern int thread_join(thread_t thread, void **retval)
     if (thread_to_join == main_thread)
         return 0;
 
-    VALGRIND_STACK_DEREGISTER(thread_to_join->valgrind_stack_id);
-    free(thread_to_join->context.uc_stack.ss_sp);
-    free(thread_to_join);
+    thread_free(thread_to_join);
     return 0;
 }
 
+/* attendre la fin de n threads, la valeur renvoyée par le i-ème est placée dans retvals[i]
+ * (ignorée si retvals est NULL). renvoie 0, ou la première erreur de thread_join.
+ */
+extern int thread_join_many(thread_t *threads, size_t n, void *retvals[])
+{
+    size_t i;
+    int err, first_err = 0;
+    for (i = 0; i < n; i++) {
+        err = thread_join(threads[i], retvals != NULL ? &retvals[i] : NULL);
+        if (err != 0 && first_err == 0)
+            first_err = err;
+    }
+    return first_err;
+}
+
+/* calls the destructors of the thread-specific values of the thread, then frees its slots.
+ * a destructor can set new values, so this is repeated at most THREAD_DESTRUCTOR_ITERATIONS times
+ */
+static void run_key_destructors(thread_struct *thread)
+{
+    int iteration, has_called_destructor = 1;
+    thread_key_t key;
+
+    if (thread->specific == NULL)
+        return;
+    for (iteration = 0; has_called_destructor && iteration < THREAD_DESTRUCTOR_ITERATIONS; iteration++) {
+        has_called_destructor = 0;
+        for (key = 0; key < THREAD_KEYS_MAX; key++) {
+            struct thread_specific *slot = &thread->specific[key];
+            void *value = slot->value;
+            if (value == NULL || !keys[key].in_use || keys[key].destructor == NULL ||
+                slot->generation != keys[key].generation)
+                continue;
+            slot->value = NULL;
+            keys[key].destructor(value);
+            has_called_destructor = 1;
+        }
+    }
+    free(thread->specific);
+    thread->specific = NULL;
+}
+
 /* terminer le thread courant en renvoyant la valeur de retour retval.
  * cette fonction ne retourne jamais.
  *
@@ -283,18 +1357,39 @@ extern int thread_join(thread_t thread, void **retval)
  */
 extern void thread_exit(void *retval)
 {
+    run_key_destructors(current_thread);
     PREEMPT_LOCK;
     current_thread->retval = retval;
     current_thread->state = TERMINATED;
+    nb_alive_threads--;
+    TRACE(TRACE_EXIT, current_thread->id, 0, 0);
     BRTREE_ERASE(current_thread, &threads, thread_struct);
+    if (current_thread->future != NULL)
+        future_done(current_thread->future, retval);
     if (current_thread->who_is_waiting_for_me != NULL)
     {
         thread_struct *waiting_thread = current_thread->who_is_waiting_for_me;
         current_thread->who_is_waiting_for_me = NULL;
+        stats_wake(waiting_thread);
         BRTREE_INSERT(waiting_thread, &threads, thread_struct);
+        if (current_thread->inline_exit != NULL) {
+            // back to thread_run_inline, on the stack of the waiting thread
+            jmp_buf *inline_exit = current_thread->inline_exit;
+            unsigned long long now = clock_ticks();
+            current_thread->cpu_time += now - start_time;
+            start_time = now;
+            waiting_thread->runnable_time += now - waiting_thread->wait_since;
+            TRACE(TRACE_SWITCH, current_thread->id, waiting_thread->id, 0);
+            if (current_thread->shared_stack != NULL)
+                current_thread->shared_stack->owner = waiting_thread;
+            current_thread = waiting_thread;
+            longjmp(*inline_exit, 1);
+        }
     }
-    PREEMPT_UNLOCK;
-    thread_yield();
+    // still running on it: the stack is released by the next thread
+    if (current_thread->context.uc_stack.ss_sp != NULL)
+        exited_thread = current_thread;
+    schedule();
     exit(0);
 }
 
@@ -305,9 +1400,11 @@ extern void thread_exit(void *retval)
  */
 extern int thread_getpriority(thread_t thread)
 {
-    if (thread == NULL)
-        return -1;
-    return ((thread_struct *)thread)->priority;
+    PREEMPT_LOCK;
+    thread_struct *t = thread_lookup(thread);
+    int priority = t != NULL ? t->priority : -1;
+    PREEMPT_UNLOCK;
+    return priority;
 }
 
 /* Modifier la valeur de priorité du thread donné
@@ -319,22 +1416,947 @@ extern int thread_getpriority(thread_t thread)
  */
 extern int thread_setpriority(thread_t thread, int priority)
 {
+    if (priority < 0 || priority > 39)
+        return -2;
+
+    PREEMPT_LOCK;
+    thread_struct *t = thread_lookup(thread);
+    if (t != NULL)
+        t->priority = priority;
+    PREEMPT_UNLOCK;
+    return t != NULL ? 0 : -1;
+}
+
+/* Obtenir les statistiques d'ordonnancement du thread donné
+ * (utilisable jusqu'à ce que le thread soit joint).
+ *
+ * retourne 0 si l'exécution n'a levé aucune erreur, -1 sinon
+ */
+extern int thread_getstats(thread_t thread, struct thread_stats *stats)
+{
+    if (stats == NULL)
+        return -1;
+
+    PREEMPT_LOCK;
+    thread_struct *t = thread_lookup(thread);
+    if (t == NULL) {
+        PREEMPT_UNLOCK;
+        return -1;
+    }
+    unsigned long long cpu_time = t->cpu_time;
+    if (t == current_thread)
+        cpu_time += clock_ticks_ordered() - start_time; // time since the last yield isn't accounted yet
+    stats->cpu_cycles = cpu_time;
+    stats->cpu_ns = ticks_to_ns(cpu_time);
+    stats->nb_voluntary_switches = t->nb_voluntary_switches;
+    stats->nb_involuntary_switches = t->nb_involuntary_switches;
+    stats->runnable_ns = ticks_to_ns(t->runnable_time);
+    stats->mutex_blocked_ns = ticks_to_ns(t->mutex_blocked_time);
+    stats->join_blocked_ns = ticks_to_ns(t->join_blocked_time);
+    stats->address_blocked_ns = ticks_to_ns(t->address_blocked_time);
+    stats->fd_blocked_ns = ticks_to_ns(t->fd_blocked_time);
+    PREEMPT_UNLOCK;
+    return 0;
+}
+
+static inline struct wait_queue *wait_queue_of(int *addr)
+{
+    // multiplicative hash: the low bits of an address are mostly its alignment
+    return &wait_table[((uintptr_t)addr * 0x9E3779B97F4A7C15ULL) >> (64 - __builtin_ctz(WAIT_TABLE_SIZE))];
+}
+
+// blocks the current thread on addr until it is woken, to be called with the preemption locked
+static void block_on_address(int *addr, thread_wait_reason reason, int blocker_id)
+{
+    current_thread->waited_address = addr;
+    TAILQ_INSERT_TAIL(wait_queue_of(addr), current_thread, wait_entry);
+    current_thread->wait_reason = reason;
+    current_thread->wait_blocker_id = blocker_id;
+    TRACE(TRACE_BLOCK, current_thread->id, blocker_id, reason);
+    BRTREE_ERASE(current_thread, &threads, thread_struct);
+    schedule();
+}
+
+// like block_on_address, but schedule makes the thread runnable again once the clock reaches
+// deadline. returns ETIMEDOUT if it did, 0 if the thread was woken
+static int block_on_address_until(int *addr, thread_wait_reason reason, int blocker_id, unsigned long long deadline)
+{
+    thread_struct *before;
+    if (clock_ticks() >= deadline)
+        return ETIMEDOUT;
+    // deadlines mostly come in increasing order, the place is searched from the end
+    TAILQ_FOREACH_REVERSE(before, &timed_waiters, timeout_queue, timeout_entry)
+        if (before->wait_deadline <= deadline)
+            break;
+    if (before != NULL)
+        TAILQ_INSERT_AFTER(&timed_waiters, before, current_thread, timeout_entry);
+    else
+        TAILQ_INSERT_HEAD(&timed_waiters, current_thread, timeout_entry);
+    current_thread->wait_deadline = deadline;
+    block_on_address(addr, reason, blocker_id);
+    // wake_address resets the deadline, expire_timeouts leaves it
+    int timed_out = current_thread->wait_deadline != 0;
+    current_thread->wait_deadline = 0;
+    return timed_out ? ETIMEDOUT : 0;
+}
+
+// makes runnable the threads whose deadline is before now, to be called with the preemption locked
+static void expire_timeouts(unsigned long long now)
+{
+    thread_struct *thread;
+    while ((thread = TAILQ_FIRST(&timed_waiters)) != NULL && thread->wait_deadline <= now) {
+        TAILQ_REMOVE(&timed_waiters, thread, timeout_entry);
+        TAILQ_REMOVE(wait_queue_of(thread->waited_address), thread, wait_entry);
+        thread->waited_address = NULL;
+        stats_wake(thread);
+        BRTREE_INSERT(thread, &threads, thread_struct);
+    }
+}
+
+/* makes runnable the threads whose descriptor is ready, after waiting at most timeout for one
+ * (NULL: without limit). epoll_wait only counts in milliseconds, so a wait with a timeout is
+ * done by ppoll on the epoll descriptor itself. to be called with the preemption locked
+ */
+static void poll_fds(const struct timespec *timeout)
+{
+    struct epoll_event events[FD_POLL_EVENTS];
+    struct pollfd epoll_pollfd = { epoll_fd, POLLIN, 0 };
+    int i, n = 0;
+    if (timeout == NULL || (timeout->tv_sec == 0 && timeout->tv_nsec == 0) ||
+        ppoll(&epoll_pollfd, 1, timeout, NULL) > 0)
+        n = epoll_wait(epoll_fd, events, FD_POLL_EVENTS, timeout == NULL ? -1 : 0);
+    for (i = 0; i < n; i++) {
+        thread_struct *thread = events[i].data.ptr;
+        if (thread == NULL) {
+            // external_fd is read before external_kicked is cleared, a later kick is never lost
+            uint64_t count;
+            if (read(external_fd, &count, sizeof(count)) == -1 && errno != EAGAIN)
+                perror("thread_yield: lecture de l'eventfd");
+            __atomic_store_n(&external_kicked, 0, __ATOMIC_SEQ_CST);
+            drain_external_wakes();
+            continue;
+        }
+        thread->fd_events = events[i].events;
+        TAILQ_REMOVE(&fd_waiters, thread, wait_entry);
+        nb_fd_waiters--;
+        stats_wake(thread);
+        BRTREE_INSERT(thread, &threads, thread_struct);
+    }
+    last_fd_poll = clock_ticks();
+    if (nb_fd_waiters > 0 && ticks_to_ns(last_fd_poll - last_fd_check) >= FD_CHECK_INTERVAL)
+        check_closed_fds();
+}
+
+/* wakes the threads whose descriptor has been closed while they wait for it, with fd_events
+ * set to -1. a number reused by a later open can't be told apart. to be called with the preemption locked
+ */
+static void check_closed_fds(void)
+{
+    thread_struct *thread, *next;
+    TAILQ_FOREACH_SAFE(thread, &fd_waiters, wait_entry, next) {
+        if (fcntl(thread->waited_fd, F_GETFD) != -1 || errno != EBADF)
+            continue;
+        thread->fd_events = -1;
+        TAILQ_REMOVE(&fd_waiters, thread, wait_entry);
+        nb_fd_waiters--;
+        stats_wake(thread);
+        BRTREE_INSERT(thread, &threads, thread_struct);
+    }
+    last_fd_check = clock_ticks();
+}
+
+/* nothing is runnable: sleeps until a descriptor is ready or the first deadline, without using
+ * the cpu (the preemption timer is stopped meanwhile). a signal only shortens the sleep, the
+ * caller checks again. to be called with the preemption locked
+ */
+static void wait_idle(void)
+{
+    static const struct itimerval stopped = { { 0, 0 }, { 0, 0 } };
+    struct timespec ts, *timeout = NULL;
+    if (!TAILQ_EMPTY(&timed_waiters)) {
+        unsigned long long now = clock_ticks(), deadline = TAILQ_FIRST(&timed_waiters)->wait_deadline;
+        unsigned long long ns = deadline > now ? ticks_to_ns(deadline - now) : 0;
+        ts.tv_sec = ns / 1000000000ULL;
+        ts.tv_nsec = ns % 1000000000ULL;
+        timeout = &ts;
+    }
+    // wakes up in time to notice the descriptors closed meanwhile
+    if (nb_fd_waiters > 0 && (timeout == NULL || ts.tv_sec * 1000000000ULL + ts.tv_nsec > FD_CHECK_INTERVAL)) {
+        ts.tv_sec = 0;
+        ts.tv_nsec = FD_CHECK_INTERVAL;
+        timeout = &ts;
+    }
+    if (USE_PREEMPTION)
+        setitimer(ITIMER_REAL, &stopped, NULL);
+    if (nb_fd_waiters > 0 || nb_parked > 0)
+        poll_fds(timeout);
+    else if (timeout->tv_sec != 0 || timeout->tv_nsec != 0)
+        nanosleep(timeout, NULL);
+    if (USE_PREEMPTION)
+        setitimer(ITIMER_REAL, &preempt_timer, NULL);
+    if (!TAILQ_EMPTY(&timed_waiters))
+        expire_timeouts(clock_ticks());
+}
+
+/* no thread can run and none of them waits for a descriptor or a deadline: nothing will ever
+ * wake them up. prints what each one waits for and aborts, to be called with the preemption locked
+ */
+static void report_deadlock(void)
+{
+    uint32_t i;
+    fprintf(stderr, "thread_yield: deadlock, tous les threads sont bloqués sans rien pour les réveiller:\n");
+    for (i = 0; i < thread_table_used; i++) {
+        thread_struct *thread = thread_table[i].thread;
+        if (thread == NULL || thread->state == TERMINATED)
+            continue;
+        fprintf(stderr, "  thread %d%s ", thread->id, thread == main_thread ? " (main)" : "");
+        if (thread->wait_reason == WAIT_MUTEX)
+            fprintf(stderr, "attend un mutex gardé par le thread %d\n", thread->wait_blocker_id);
+        else if (thread->wait_reason == WAIT_JOIN && thread->wait_blocker_id != 0)
+            fprintf(stderr, "attend la fin du thread %d\n", thread->wait_blocker_id);
+        else if (thread->wait_reason == WAIT_JOIN)
+            fprintf(stderr, "attend une tâche ou un pool de threads\n");
+        else
+            fprintf(stderr, "attend à l'adresse %p\n", (void *)thread->waited_address);
+    }
+    abort();
+}
+
+// wakes at most nb_threads threads blocked on addr, to be called with the preemption locked
+static int wake_address(int *addr, int nb_threads)
+{
+    struct wait_queue *queue = wait_queue_of(addr);
+    thread_struct *thread, *next;
+    int nb_woken = 0;
+
+    TAILQ_FOREACH_SAFE(thread, queue, wait_entry, next) {
+        if (nb_woken == nb_threads)
+            break;
+        if (thread->waited_address != addr)
+            continue;
+        TAILQ_REMOVE(queue, thread, wait_entry);
+        thread->waited_address = NULL;
+        if (thread->wait_deadline != 0) {
+            TAILQ_REMOVE(&timed_waiters, thread, timeout_entry);
+            thread->wait_deadline = 0;
+        }
+        stats_wake(thread);
+        BRTREE_INSERT(thread, &threads, thread_struct);
+        nb_woken++;
+    }
+    return nb_woken;
+}
+
+/* Attendre sur une adresse
+ */
+int thread_wait_on(int *addr, int expected)
+{
+    PREEMPT_LOCK;
+    // checked with the preemption locked: a thread_wake can't happen between the test and the sleep
+    if (*addr != expected) {
+        PREEMPT_UNLOCK;
+        return EAGAIN;
+    }
+    block_on_address(addr, WAIT_ADDRESS, 0);
+    PREEMPT_UNLOCK;
+    return 0;
+}
+
+int thread_timedwait_on(int *addr, int expected, unsigned long long timeout_ns)
+{
+    unsigned long long deadline = deadline_after(timeout_ns);
+    PREEMPT_LOCK;
+    if (*addr != expected) {
+        PREEMPT_UNLOCK;
+        return EAGAIN;
+    }
+    int err = block_on_address_until(addr, WAIT_ADDRESS, 0, deadline);
+    PREEMPT_UNLOCK;
+    return err;
+}
+
+int thread_wake(int *addr, int nb_threads)
+{
+    PREEMPT_LOCK;
+    int nb_woken = wake_address(addr, nb_threads);
+    PREEMPT_UNLOCK;
+    return nb_woken;
+}
+
+// creates epoll_fd the first time, to be called with the preemption locked
+static int epoll_instance(void)
+{
+    if (epoll_fd == -1)
+        epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    return epoll_fd;
+}
+
+// poll(2) and epoll share the values of POLLIN, POLLOUT... the descriptor is registered for one
+// wakeup only, and removed once the thread runs again. EPOLLHUP and EPOLLERR are always reported
+int thread_wait_fd(int fd, short events)
+{
+    struct pollfd ready = { fd, events, 0 };
+    struct epoll_event event = { .events = (uint32_t)events | EPOLLONESHOT };
+    // a descriptor that is already ready doesn't need to wait for the next poll
+    if (poll(&ready, 1, 0) != 0) {
+        if (ready.revents & POLLNVAL) {
+            errno = EBADF;
+            return -1;
+        }
+        return ready.revents != 0 ? ready.revents : -1;
+    }
+    PREEMPT_LOCK;
+    if (epoll_instance() == -1) {
+        PREEMPT_UNLOCK;
+        return -1;
+    }
+    event.data.ptr = current_thread;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+        PREEMPT_UNLOCK;
+        return -1;
+    }
+    nb_fd_waiters++;
+    current_thread->waited_fd = fd;
+    TAILQ_INSERT_TAIL(&fd_waiters, current_thread, wait_entry);
+    current_thread->wait_reason = WAIT_FD;
+    current_thread->wait_blocker_id = 0;
+    TRACE(TRACE_BLOCK, current_thread->id, fd, WAIT_FD);
+    BRTREE_ERASE(current_thread, &threads, thread_struct);
+    schedule();
+    // once closed, the number may already be registered again by another thread
+    int fd_events = current_thread->fd_events;
+    if (fd_events != -1)
+        epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+    PREEMPT_UNLOCK;
+    if (fd_events == -1)
+        errno = EBADF;
+    return fd_events;
+}
+
+// creates external_fd the first time, from any kernel thread: the loser of a race closes its own
+static int external_eventfd(void)
+{
+    int fd = __atomic_load_n(&external_fd, __ATOMIC_ACQUIRE), none = -1;
+    if (fd != -1)
+        return fd;
+    if ((fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) == -1)
+        return -1;
+    if (!__atomic_compare_exchange_n(&external_fd, &none, fd, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        close(fd);
+        fd = none;
+    }
+    return fd;
+}
+
+// makes runnable the parked threads woken by thread_wake_external, or gives a token to the
+// others, in the order of the calls. to be called with the preemption locked
+static void drain_external_wakes(void)
+{
+    struct external_wake *wake = __atomic_exchange_n(&external_wakes, NULL, __ATOMIC_SEQ_CST);
+    struct external_wake *oldest = NULL, *next;
+    for (; wake != NULL; wake = next) {
+        next = wake->next;
+        wake->next = oldest;
+        oldest = wake;
+    }
+    for (wake = oldest; wake != NULL; wake = next) {
+        thread_struct *thread = thread_lookup(wake->thread);
+        next = wake->next;
+        free(wake);
+        if (thread == NULL || thread->state == TERMINATED)
+            continue;
+        if (thread->wait_reason == WAIT_PARK) {
+            nb_parked--;
+            stats_wake(thread);
+            BRTREE_INSERT(thread, &threads, thread_struct);
+        } else {
+            thread->park_token = 1;
+        }
+    }
+}
+
+int thread_wake_external(thread_t thread)
+{
+    struct external_wake *wake;
+    int fd;
     if (thread == NULL)
         return -1;
+    if ((fd = external_eventfd()) == -1 || (wake = malloc(sizeof(*wake))) == NULL)
+        return -1;
+    wake->thread = thread;
+    wake->next = __atomic_load_n(&external_wakes, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&external_wakes, &wake->next, wake, 1, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED))
+        ;
+    // one write per batch: the scheduler clears external_kicked before draining
+    if (__atomic_exchange_n(&external_kicked, 1, __ATOMIC_SEQ_CST) == 0) {
+        uint64_t one = 1;
+        if (write(fd, &one, sizeof(one)) == -1 && errno != EAGAIN)
+            return -1;
+    }
+    return 0;
+}
 
-    if (priority < 0 || priority > 39)
-        return -2;
+int thread_park(void)
+{
+    PREEMPT_LOCK;
+    if (!external_registered) {
+        struct epoll_event event = { .events = EPOLLIN, .data.ptr = NULL };
+        int fd = external_eventfd();
+        if (fd == -1 || epoll_instance() == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+            PREEMPT_UNLOCK;
+            return -1;
+        }
+        external_registered = 1;
+    }
+    drain_external_wakes();
+    if (!current_thread->park_token) {
+        nb_parked++;
+        current_thread->wait_reason = WAIT_PARK;
+        current_thread->wait_blocker_id = 0;
+        TRACE(TRACE_BLOCK, current_thread->id, 0, WAIT_PARK);
+        BRTREE_ERASE(current_thread, &threads, thread_struct);
+        schedule();
+    }
+    current_thread->park_token = 0;
+    PREEMPT_UNLOCK;
+    return 0;
+}
+
+// the future starts running, in its own thread or inline in thread_future_get
+static void future_started(struct thread_future *future)
+{
+    future->state = FUTURE_RUNNING;
+    if (future->parent != NULL) { // the parent thread has terminated, nobody else can free it
+        thread_free(future->parent->thread);
+        free(future->parent);
+        future->parent = NULL;
+    }
+}
+
+// to be called with the preemption locked
+static void future_done(struct thread_future *future, void *retval)
+{
+    future->retval = retval;
+    future->state = FUTURE_DONE;
+    wake_address(&future->state, INT_MAX);
+    if (future->continuation != NULL) {
+        struct thread_future *continuation = future->continuation;
+        continuation->thread->start_arg = retval;
+        continuation->state = FUTURE_READY;
+        thread_make_runnable(continuation->thread);
+        wake_address(&continuation->state, INT_MAX); // a thread_future_get can now run it inline
+    }
+}
+
+static struct thread_future *future_new(void *(*func)(void *), void *funcarg)
+{
+    struct thread_future *future = malloc(sizeof(struct thread_future));
+    if (future == NULL)
+        return NULL;
+    future->thread = thread_new(func, funcarg);
+    if (future->thread == NULL) {
+        free(future);
+        return NULL;
+    }
+    future->thread->future = future;
+    future->state = FUTURE_WAITING;
+    future->retval = NULL;
+    future->continuation = NULL;
+    future->parent = NULL;
+    return future;
+}
+
+/* Futures
+ */
+thread_future_t thread_async(void *(*func)(void *), void *funcarg)
+{
+    struct thread_future *future = future_new(func, funcarg);
+    if (future == NULL)
+        return NULL;
+    PREEMPT_LOCK;
+    future->state = FUTURE_READY;
+    thread_make_runnable(future->thread);
+    PREEMPT_UNLOCK;
+    return future;
+}
+
+thread_future_t thread_future_then(thread_future_t future, void *(*func)(void *))
+{
+    if (future == NULL || future->continuation != NULL)
+        return NULL;
+    struct thread_future *continuation = future_new(func, NULL);
+    if (continuation == NULL)
+        return NULL;
+
+    PREEMPT_LOCK;
+    continuation->parent = future;
+    if (future->state == FUTURE_DONE) {
+        continuation->thread->start_arg = future->retval;
+        continuation->state = FUTURE_READY;
+        thread_make_runnable(continuation->thread);
+    } else {
+        future->continuation = continuation;
+    }
+    PREEMPT_UNLOCK;
+    return continuation;
+}
+
+int thread_future_get(thread_future_t future, void **retval)
+{
+    if (future == NULL)
+        return EINVAL;
+    if (future->thread == current_thread)
+        return EDEADLK;
+
+    PREEMPT_LOCK;
+    while (future->state != FUTURE_DONE) {
+        if (future->state == FUTURE_READY) {
+            // not started yet: runs inline, without stack allocation
+            future->thread->who_is_waiting_for_me = current_thread;
+            current_thread->wait_reason = WAIT_JOIN;
+            current_thread->wait_blocker_id = future->thread->id;
+            TRACE(TRACE_BLOCK, current_thread->id, future->thread->id, WAIT_JOIN);
+            BRTREE_ERASE(current_thread, &threads, thread_struct);
+            thread_run_inline(future->thread);
+        } else {
+            block_on_address(&future->state, WAIT_JOIN, future->thread->id);
+        }
+    }
+    PREEMPT_UNLOCK;
+
+    if (retval != NULL)
+        *retval = future->retval;
+    thread_free(future->thread);
+    free(future);
+    return 0;
+}
+
+int thread_future_wait_for(thread_future_t future, unsigned long long timeout_ns)
+{
+    if (future == NULL)
+        return EINVAL;
+    // future_done wakes the threads waiting on the state, the deadline the others
+    unsigned long long deadline = deadline_after(timeout_ns);
+    int err = 0;
+    PREEMPT_LOCK;
+    while (future->state != FUTURE_DONE && err == 0)
+        err = block_on_address_until(&future->state, WAIT_JOIN, future->thread->id, deadline);
+    PREEMPT_UNLOCK;
+    return err;
+}
+
+/* Tâches fork-join
+ */
+// to be called with the preemption locked
+static void task_remove(thread_task_t *task)
+{
+    if (task->prev != NULL)
+        task->prev->next = task->next;
+    else
+        pending_tasks_head = task->next;
+    if (task->next != NULL)
+        task->next->prev = task->prev;
+    else
+        pending_tasks_tail = task->prev;
+}
+
+// runs pending tasks from the oldest one, blocks while there is none
+static void *task_worker(void *arg)
+{
+    (void)arg;
+    PREEMPT_LOCK;
+    while (1) {
+        thread_task_t *task = pending_tasks_tail;
+        if (task == NULL) {
+            nb_idle_workers++; // decremented by the thread_task_spawn waking us
+            block_on_address(&nb_idle_workers, WAIT_ADDRESS, 0);
+            continue;
+        }
+        task_remove(task);
+        task->state = TASK_RUNNING;
+        current_thread->task_worker = TASK_WORKER_BUSY;
+        PREEMPT_UNLOCK;
+        task->retval = task->func(task->arg);
+        PREEMPT_LOCK;
+        current_thread->task_worker = TASK_WORKER_IDLE;
+        task->state = TASK_DONE;
+        wake_address(&task->state, INT_MAX);
+    }
+    return NULL;
+}
+
+// workers are only given a stack when they are dispatched, so tasks never yielding cost none.
+// to be called with the preemption locked
+static int task_start_worker(void)
+{
+    thread_struct *worker = thread_new(task_worker, NULL);
+    if (worker == NULL)
+        return -1;
+    worker->task_worker = TASK_WORKER_IDLE;
+    nb_task_workers++;
+    thread_make_runnable(worker);
+    return 0;
+}
+
+static void task_start_workers(void)
+{
+    int i;
+    task_workers_started = 1;
+    for (i = 0; i < TASK_WORKERS; i++) {
+        if (task_start_worker() == -1)
+            break;
+    }
+}
+
+// the tasks still pending may be the ones the blocked workers wait for: once every worker is
+// blocked in its task, another one is started to run them. to be called with the preemption locked
+static void task_worker_blocked(void)
+{
+    current_thread->task_worker = TASK_WORKER_BLOCKED;
+    nb_blocked_task_workers++;
+    if (nb_blocked_task_workers == nb_task_workers && pending_tasks_tail != NULL &&
+        nb_task_workers < TASK_WORKERS_MAX)
+        task_start_worker();
+}
+
+int thread_task_spawn(thread_task_t *task, void *(*func)(void *), void *arg)
+{
+    if (task == NULL || func == NULL)
+        return EINVAL;
+    task->func = func;
+    task->arg = arg;
+    task->retval = NULL;
+    task->state = TASK_PENDING;
+    task->prev = NULL;
 
-    ((thread_struct *)thread)->priority = priority;
+    PREEMPT_LOCK;
+    if (!task_workers_started)
+        task_start_workers();
+    task->next = pending_tasks_head;
+    if (pending_tasks_head != NULL)
+        pending_tasks_head->prev = task;
+    else
+        pending_tasks_tail = task;
+    pending_tasks_head = task;
+    if (nb_idle_workers > 0 && wake_address(&nb_idle_workers, 1) == 1)
+        nb_idle_workers--;
+    else if (nb_blocked_task_workers == nb_task_workers && nb_task_workers < TASK_WORKERS_MAX)
+        task_start_worker();
+    PREEMPT_UNLOCK;
     return 0;
 }
 
+int thread_task_sync(thread_task_t *task, void **retval)
+{
+    if (task == NULL)
+        return EINVAL;
+
+    PREEMPT_LOCK;
+    if (task->state == TASK_PENDING) {
+        // not picked by a worker: runs inline, nobody else can see it anymore
+        task_remove(task);
+        task->state = TASK_RUNNING;
+        PREEMPT_UNLOCK;
+        task->retval = task->func(task->arg);
+        task->state = TASK_DONE;
+    } else {
+        while (task->state != TASK_DONE) {
+            block_on_address(&task->state, WAIT_JOIN, 0);
+        }
+        PREEMPT_UNLOCK;
+    }
+
+    if (retval != NULL)
+        *retval = task->retval;
+    return 0;
+}
+
+/* Groupes de threads
+ */
+static void *pool_worker(void *arg)
+{
+    struct thread_pool *pool = arg;
+    PREEMPT_LOCK;
+    while (1) {
+        if (pool->nb_queued == 0) {
+            if (pool->stopping)
+                break;
+            pool->nb_idle_workers++; // decremented by the thread waking us
+            block_on_address(&pool->nb_idle_workers, WAIT_ADDRESS, 0);
+            continue;
+        }
+        struct thread_pool_job job = pool->jobs[pool->head];
+        pool->head = (pool->head + 1) % pool->queue_size;
+        pool->nb_queued--;
+        if (pool->nb_blocked_submitters > 0 && wake_address(&pool->nb_blocked_submitters, 1) == 1)
+            pool->nb_blocked_submitters--;
+        PREEMPT_UNLOCK;
+        job.func(job.arg);
+        PREEMPT_LOCK;
+        if (--pool->nb_unfinished == 0)
+            wake_address(&pool->nb_unfinished, INT_MAX);
+    }
+    PREEMPT_UNLOCK;
+    return NULL;
+}
+
+// a worker waiting for its own pool would never be woken
+static int pool_is_worker(struct thread_pool *pool)
+{
+    int i;
+    for (i = 0; i < pool->nb_workers; i++)
+        if (pool->workers[i] == current_thread->handle)
+            return 1;
+    return 0;
+}
+
+thread_pool_t thread_pool_create(int nb_threads, int queue_size)
+{
+    if (nb_threads <= 0 || queue_size <= 0)
+        return NULL;
+    struct thread_pool *pool = malloc(sizeof(struct thread_pool));
+    if (pool == NULL)
+        return NULL;
+    pool->workers = malloc(nb_threads * sizeof(thread_t));
+    pool->jobs = malloc(queue_size * sizeof(struct thread_pool_job));
+    if (pool->workers == NULL || pool->jobs == NULL) {
+        free(pool->workers);
+        free(pool->jobs);
+        free(pool);
+        return NULL;
+    }
+    pool->nb_workers = 0;
+    pool->queue_size = queue_size;
+    pool->head = 0;
+    pool->nb_queued = 0;
+    pool->nb_unfinished = 0;
+    pool->nb_idle_workers = 0;
+    pool->nb_blocked_submitters = 0;
+    pool->stopping = 0;
+
+    while (pool->nb_workers < nb_threads) {
+        if (thread_create(&pool->workers[pool->nb_workers], pool_worker, pool) == -1) {
+            thread_pool_destroy(pool);
+            return NULL;
+        }
+        pool->nb_workers++;
+    }
+    return pool;
+}
+
+int thread_pool_submit(thread_pool_t pool, void (*func)(void *), void *arg)
+{
+    if (pool == NULL || func == NULL)
+        return EINVAL;
+
+    PREEMPT_LOCK;
+    if (pool->stopping) {
+        PREEMPT_UNLOCK;
+        return EINVAL;
+    }
+    while (pool->nb_queued == pool->queue_size) {
+        if (pool_is_worker(pool)) {
+            PREEMPT_UNLOCK;
+            return EDEADLK;
+        }
+        pool->nb_blocked_submitters++; // decremented by the worker waking us
+        block_on_address(&pool->nb_blocked_submitters, WAIT_ADDRESS, 0);
+    }
+    struct thread_pool_job *job = &pool->jobs[(pool->head + pool->nb_queued) % pool->queue_size];
+    job->func = func;
+    job->arg = arg;
+    pool->nb_queued++;
+    pool->nb_unfinished++;
+    if (pool->nb_idle_workers > 0 && wake_address(&pool->nb_idle_workers, 1) == 1)
+        pool->nb_idle_workers--;
+    PREEMPT_UNLOCK;
+    return 0;
+}
+
+int thread_pool_wait_all(thread_pool_t pool)
+{
+    if (pool == NULL)
+        return EINVAL;
+    if (pool_is_worker(pool))
+        return EDEADLK;
+
+    PREEMPT_LOCK;
+    while (pool->nb_unfinished > 0) {
+        block_on_address(&pool->nb_unfinished, WAIT_JOIN, 0);
+    }
+    PREEMPT_UNLOCK;
+    return 0;
+}
+
+int thread_pool_destroy(thread_pool_t pool)
+{
+    int i, err;
+    if (pool == NULL)
+        return EINVAL;
+    if ((err = thread_pool_wait_all(pool)) != 0)
+        return err;
+
+    PREEMPT_LOCK;
+    pool->stopping = 1;
+    wake_address(&pool->nb_idle_workers, INT_MAX);
+    pool->nb_idle_workers = 0;
+    PREEMPT_UNLOCK;
+    for (i = 0; i < pool->nb_workers; i++)
+        thread_join(pool->workers[i], NULL);
+
+    free(pool->workers);
+    free(pool->jobs);
+    free(pool);
+    return 0;
+}
+
+/* Données propres à chaque thread
+ */
+int thread_key_create(thread_key_t *key, void (*destructor)(void *))
+{
+    thread_key_t i;
+    PREEMPT_LOCK;
+    for (i = 0; i < THREAD_KEYS_MAX; i++) {
+        if (!keys[i].in_use) {
+            keys[i].in_use = 1;
+            keys[i].generation++; // invalidates the values left by the previous owner of the key
+            keys[i].destructor = destructor;
+            *key = i;
+            PREEMPT_UNLOCK;
+            return 0;
+        }
+    }
+    PREEMPT_UNLOCK;
+    return EAGAIN;
+}
+
+int thread_key_delete(thread_key_t key)
+{
+    PREEMPT_LOCK;
+    if (key >= THREAD_KEYS_MAX || !keys[key].in_use) {
+        PREEMPT_UNLOCK;
+        return EINVAL;
+    }
+    keys[key].in_use = 0;
+    PREEMPT_UNLOCK;
+    return 0;
+}
+
+int thread_setspecific(thread_key_t key, const void *value)
+{
+    if (key >= THREAD_KEYS_MAX || !keys[key].in_use)
+        return EINVAL;
+    if (current_thread->specific == NULL) {
+        current_thread->specific = calloc(THREAD_KEYS_MAX, sizeof(struct thread_specific));
+        if (current_thread->specific == NULL)
+            return ENOMEM;
+    }
+    current_thread->specific[key].generation = keys[key].generation;
+    current_thread->specific[key].value = (void *)value;
+    return 0;
+}
+
+void *thread_getspecific(thread_key_t key)
+{
+    struct thread_specific *specific = current_thread->specific;
+    if (key >= THREAD_KEYS_MAX || specific == NULL || specific[key].generation != keys[key].generation)
+        return NULL;
+    return specific[key].value;
+}
+
+/* Mutex built on the thread_wait_on queues, like a futex mutex:
+ * state is 0 when free, 1 when locked, 2 when locked and threads may be waiting.
+ * unlock only looks for a waiter in state 2. The woken waiter takes the mutex again
+ * instead of receiving it, so the unlocking thread can relock it without blocking.
+ * Before parking, a contended lock gives the cpu directly to a runnable owner, as long as
+ * the mutex is usually released soon after it is contended (see mutex_yield_to_owner).
+ * Only the contended locks read the clock: the first waiter of a hold sets contended_since,
+ * and the unlock adds the time since then to wait_ewma.
+ */
 int thread_mutex_init(thread_mutex_t *mutex)
 {
-    (void)mutex;
     mutex->owner = NULL;
+    mutex->state = 0;
+    mutex->contended_since = 0;
+    mutex->wait_ewma = 0;
+    mutex->profile = NULL;
+    if (mutex_profile_enabled) {
+        // without memory, the mutex works but isn't profiled
+        struct mutex_profile *profile = calloc(1, sizeof(struct mutex_profile));
+        if (profile != NULL) {
+            profile->data.site = __builtin_return_address(0);
+            PREEMPT_LOCK;
+            profile->next = mutex_profiles;
+            mutex_profiles = profile;
+            PREEMPT_UNLOCK;
+            mutex->profile = profile;
+        }
+    }
     return 0;
 }
+
+// a wait for the mutex started at wait_start ended at now, to be called with the preemption locked
+static void mutex_profile_waited(struct mutex_profile *profile, unsigned long long wait_start, unsigned long long now)
+{
+    unsigned long long wait = now - wait_start;
+    profile->data.nb_contended++;
+    profile->data.wait_cycles += wait;
+    if (wait > profile->data.max_wait_cycles)
+        profile->data.max_wait_cycles = wait;
+}
+
+// a timedlock gave up waiting since wait_start: not an acquisition, so kept out of the waits
+// that the dump relates to the acquisitions. to be called with the preemption locked
+static void mutex_profile_timed_out(struct mutex_profile *profile, unsigned long long wait_start)
+{
+    profile->data.nb_timeouts++;
+    profile->data.timeout_cycles += clock_ticks() - wait_start;
+}
+
+// the current thread took the mutex, after waiting since wait_start unless it is 0.
+// to be called with the preemption locked
+static void mutex_profile_acquired(struct mutex_profile *profile, unsigned long long wait_start)
+{
+    unsigned long long now = clock_ticks();
+    profile->data.nb_acquisitions++;
+    if (wait_start != 0)
+        mutex_profile_waited(profile, wait_start, now);
+    profile->locked_at = now;
+}
+
+// to be called with the preemption locked
+static void mutex_profile_released(struct mutex_profile *profile)
+{
+    unsigned long long hold = clock_ticks() - profile->locked_at;
+    unsigned long long ns = ticks_to_ns(hold);
+    int bucket = ns < 2 ? 0 : 63 - __builtin_clzll(ns);
+    if (bucket >= THREAD_MUTEX_PROFILE_BUCKETS)
+        bucket = THREAD_MUTEX_PROFILE_BUCKETS - 1;
+    profile->data.hold_cycles += hold;
+    profile->data.hold_histogram[bucket]++;
+}
+
+// the adaptive part of a contended lock, with a single cpu the equivalent of spinning while the
+// owner runs on another one: while the owner is runnable, it gets the cpu directly so that it can
+// leave its critical section, for up to twice the recent mean wait. a mutex usually waited for
+// longer than a scheduler slice, or an owner that is blocked, is waited for in the queue right away.
+// to be called with the preemption locked
+static void mutex_yield_to_owner(thread_mutex_t *mutex)
+{
+    unsigned long long start = clock_ticks(), budget = 2 * mutex->wait_ewma;
+    int i;
+
+    if (mutex->contended_since == 0)
+        mutex->contended_since = start;
+    if (mutex->wait_ewma > (unsigned long long) max_ticks_until_reorder)
+        return;
+    for (i = 0; i < MUTEX_MAX_YIELDS_TO_OWNER && mutex->state != 0; i++) {
+        thread_struct *owner = mutex->owner;
+        if (owner == current_thread || !BRTREE_IS_IN_TREE(owner, &threads) || (i > 0 && clock_ticks() - start > budget))
+            return;
+        yield_to_locked(owner);
+    }
+}
 int thread_mutex_destroy(thread_mutex_t *mutex)
 {
     (void)mutex;
@@ -342,38 +2364,284 @@ int thread_mutex_destroy(thread_mutex_t *mutex)
 }
 int thread_mutex_lock(thread_mutex_t *mutex)
 {
-    (void)mutex;
+    unsigned long long wait_start = 0;
     PREEMPT_LOCK;
-    if (mutex->owner == NULL) {
-        mutex->owner = (thread_t) current_thread;
-        PREEMPT_UNLOCK;
+    if (mutex->state != 0) {
+        if (mutex->profile != NULL)
+            wait_start = clock_ticks();
+        mutex_yield_to_owner(mutex);
+    }
+    if (mutex->state == 0) {
+        mutex->state = 1;
     } else {
-        struct thread_struct *last = (struct thread_struct *)mutex->owner;
-        while (last->next_in_mutex_queue != NULL) {
-            if (BRTREE_KEY(last->next_in_mutex_queue) < BRTREE_KEY(current_thread)) break;
-            last = last->next_in_mutex_queue;
-        }
-        if (last->next_in_mutex_queue != NULL) current_thread->next_in_mutex_queue = last->next_in_mutex_queue;
-        last->next_in_mutex_queue = current_thread;
-        BRTREE_ERASE(current_thread, &threads, thread_struct);
-        PREEMPT_UNLOCK;
-        thread_yield();
+        do {
+            mutex->state = 2;
+            block_on_address(&mutex->state, WAIT_MUTEX, (mutex->owner)->id);
+        } while (mutex->state != 0);
+        mutex->state = 2; // other threads may still be waiting
+    }
+    mutex->owner = current_thread;
+    if (mutex->profile != NULL)
+        mutex_profile_acquired(mutex->profile, wait_start);
+    PREEMPT_UNLOCK;
+    return 0;
+}
+int thread_mutex_trylock(thread_mutex_t *mutex)
+{
+    int err = EBUSY;
+    PREEMPT_LOCK;
+    if (mutex->state == 0) {
+        mutex->state = 1;
+        mutex->owner = current_thread;
+        if (mutex->profile != NULL)
+            mutex_profile_acquired(mutex->profile, 0);
+        err = 0;
+    }
+    PREEMPT_UNLOCK;
+    return err;
+}
+// a waiter that times out leaves the state to 2: the next unlock looks for a waiter for nothing
+int thread_mutex_timedlock(thread_mutex_t *mutex, unsigned long long timeout_ns)
+{
+    unsigned long long deadline = deadline_after(timeout_ns);
+    unsigned long long wait_start = 0;
+    PREEMPT_LOCK;
+    if (mutex->state != 0) {
+        if (mutex->profile != NULL)
+            wait_start = clock_ticks();
+        mutex_yield_to_owner(mutex);
+    }
+    if (mutex->state == 0) {
+        mutex->state = 1;
+    } else {
+        do {
+            mutex->state = 2;
+            if (block_on_address_until(&mutex->state, WAIT_MUTEX, (mutex->owner)->id, deadline) == ETIMEDOUT &&
+                mutex->state != 0) {
+                if (mutex->profile != NULL)
+                    mutex_profile_timed_out(mutex->profile, wait_start);
+                PREEMPT_UNLOCK;
+                return ETIMEDOUT;
+            }
+        } while (mutex->state != 0);
+        mutex->state = 2; // other threads may still be waiting
     }
+    mutex->owner = current_thread;
+    if (mutex->profile != NULL)
+        mutex_profile_acquired(mutex->profile, wait_start);
+    PREEMPT_UNLOCK;
     return 0;
 }
 int thread_mutex_unlock(thread_mutex_t *mutex)
 {
-    (void)mutex;
     PREEMPT_LOCK;
-    if (mutex->owner != (thread_t)current_thread) return -1;
+    if (mutex->owner != current_thread) {
+        PREEMPT_UNLOCK;
+        return -1;
+    }
+
+    int has_waiters = mutex->state == 2;
+    if (mutex->contended_since != 0) {
+        unsigned long long wait = clock_ticks() - mutex->contended_since;
+        mutex->wait_ewma += (wait >> MUTEX_WAIT_EWMA_SHIFT) - (mutex->wait_ewma >> MUTEX_WAIT_EWMA_SHIFT);
+        mutex->contended_since = 0;
+    }
+    if (mutex->profile != NULL)
+        mutex_profile_released(mutex->profile);
+    mutex->owner = NULL;
+    mutex->state = 0;
+    if (has_waiters)
+        wake_address(&mutex->state, 1);
+    PREEMPT_UNLOCK;
+    return 0;
+}
+
+/* Profil de contention des mutex
+ */
+int thread_mutex_profile_start(void)
+{
+    mutex_profile_enabled = 1;
+    return 0;
+}
+
+int thread_mutex_setname(thread_mutex_t *mutex, const char *name)
+{
+    if (mutex == NULL || mutex->profile == NULL || name == NULL)
+        return -1;
+    char *copy = strdup(name);
+    if (copy == NULL)
+        return -1;
+    free((char *)mutex->profile->data.name);
+    mutex->profile->data.name = copy;
+    return 0;
+}
+
+int thread_mutex_getprofile(thread_mutex_t *mutex, struct thread_mutex_profile *profile)
+{
+    if (mutex == NULL || mutex->profile == NULL || profile == NULL)
+        return -1;
+    PREEMPT_LOCK;
+    *profile = mutex->profile->data;
+    PREEMPT_UNLOCK;
+    return 0;
+}
+
+// by decreasing total wait, then number of waits
+static int mutex_profile_compare(const void *a, const void *b)
+{
+    const struct thread_mutex_profile *pa = &(*(struct mutex_profile *const *)a)->data;
+    const struct thread_mutex_profile *pb = &(*(struct mutex_profile *const *)b)->data;
+    if (pa->wait_cycles != pb->wait_cycles)
+        return pa->wait_cycles < pb->wait_cycles ? 1 : -1;
+    return (pa->nb_contended < pb->nb_contended) - (pa->nb_contended > pb->nb_contended);
+}
+
+// upper bound in ns of the bucket below which a fraction q of the hold times is
+static unsigned long long mutex_profile_hold_quantile(const struct thread_mutex_profile *data, double q)
+{
+    unsigned long long nb_holds = 0, seen = 0;
+    int i;
+    for (i = 0; i < THREAD_MUTEX_PROFILE_BUCKETS; i++)
+        nb_holds += data->hold_histogram[i];
+    for (i = 0; i < THREAD_MUTEX_PROFILE_BUCKETS - 1; i++) {
+        seen += data->hold_histogram[i];
+        if (seen >= q * nb_holds)
+            break;
+    }
+    return 2ULL << i;
+}
+
+// the object and the closest exported symbol of a call site, for addr2line
+static void mutex_profile_print_site(FILE *file, void *site)
+{
+    Dl_info info;
+    if (dladdr(site, &info) == 0 || info.dli_fname == NULL) {
+        fprintf(file, "%p", site);
+        return;
+    }
+    fprintf(file, "%s+%#lx", info.dli_fname, (unsigned long)((char *)site - (char *)info.dli_fbase));
+    if (info.dli_sname != NULL)
+        fprintf(file, " %s+%#lx", info.dli_sname, (unsigned long)((char *)site - (char *)info.dli_saddr));
+}
+
+int thread_mutex_profile_dump(const char *path, unsigned int nb_mutexes)
+{
+    struct mutex_profile *profile, **sorted;
+    size_t nb_profiles = 0, i;
+
+    PREEMPT_LOCK;
+    for (profile = mutex_profiles; profile != NULL; profile = profile->next)
+        nb_profiles++;
+    sorted = malloc((nb_profiles + 1) * sizeof(*sorted));
+    if (sorted == NULL) {
+        PREEMPT_UNLOCK;
+        return -1;
+    }
+    for (profile = mutex_profiles, i = 0; profile != NULL; profile = profile->next)
+        sorted[i++] = profile;
+    PREEMPT_UNLOCK;
+    qsort(sorted, nb_profiles, sizeof(*sorted), mutex_profile_compare);
+    if (nb_mutexes != 0 && nb_mutexes < nb_profiles)
+        nb_profiles = nb_mutexes;
+
+    FILE *file = path != NULL ? fopen(path, "w") : stderr;
+    if (file == NULL) {
+        free(sorted);
+        return -1;
+    }
+    fprintf(file, "libthread mutex profile, by total wait:\n");
+    for (i = 0; i < nb_profiles; i++) {
+        const struct thread_mutex_profile *data = &sorted[i]->data;
+        fprintf(file, "#%zu %s (", i + 1, data->name != NULL ? data->name : "unnamed");
+        mutex_profile_print_site(file, data->site);
+        fprintf(file, ")\n   %llu acquisitions, %llu waits (%.1f%%), wait %.3f ms total / %.3f ms max, "
+                      "hold %llu ns mean / < %llu ns p50 / < %llu ns p99\n",
+                data->nb_acquisitions, data->nb_contended,
+                data->nb_acquisitions != 0 ? 100.0 * data->nb_contended / data->nb_acquisitions : 0.0,
+                ticks_to_ns(data->wait_cycles) / 1e6, ticks_to_ns(data->max_wait_cycles) / 1e6,
+                data->nb_acquisitions != 0 ? ticks_to_ns(data->hold_cycles) / data->nb_acquisitions : 0,
+                mutex_profile_hold_quantile(data, 0.5), mutex_profile_hold_quantile(data, 0.99));
+        if (data->nb_timeouts != 0)
+            fprintf(file, "   %llu timeouts, %.3f ms total\n", data->nb_timeouts, ticks_to_ns(data->timeout_cycles) / 1e6);
+    }
+    free(sorted);
+    if (file != stderr && fclose(file) != 0)
+        return -1;
+    return 0;
+}
+
+/* Démarrer l'enregistrement des événements d'ordonnancement
+ * dans un tampon circulaire de nb_events événements (0 pour la taille par défaut).
+ */
+int thread_trace_start(const char *path, unsigned long nb_events)
+{
+    if (trace_header != NULL)
+        return -1;
+    if (nb_events == 0)
+        nb_events = TRACE_DEFAULT_NB_EVENTS;
 
-    if (current_thread->next_in_mutex_queue == NULL) {
-        mutex->owner = NULL;
+    size_t size = sizeof(struct trace_header) + nb_events * sizeof(struct trace_event);
+    void *mapping;
+    if (path != NULL) {
+        int fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0)
+            return -1;
+        if (ftruncate(fd, size) != 0) {
+            close(fd);
+            return -1;
+        }
+        mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        close(fd);
     } else {
-        BRTREE_INSERT(current_thread->next_in_mutex_queue, &threads, thread_struct);
-        mutex->owner = (thread_t) current_thread->next_in_mutex_queue;
-        current_thread->next_in_mutex_queue = NULL;
+        mapping = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
     }
+    if (mapping == MAP_FAILED)
+        return -1;
+
+    struct trace_header *header = mapping;
+    memcpy(header->magic, "THRTRACE", sizeof(header->magic));
+    header->version = 1;
+    header->event_size = sizeof(struct trace_event);
+    header->nb_events = nb_events;
+    header->head = 0;
+    header->start_ticks = clock_ticks();
+    header->ns_per_tick = ns_per_tick;
+
+    PREEMPT_LOCK;
+    trace_events = (struct trace_event *)(header + 1);
+    trace_mapping_size = size;
+    trace_header = header;
     PREEMPT_UNLOCK;
     return 0;
 }
+
+/* Écrire les événements enregistrés jusqu'ici dans le fichier path.
+ */
+int thread_trace_save(const char *path)
+{
+    if (trace_header == NULL)
+        return -1;
+    FILE *file = fopen(path, "wb");
+    if (file == NULL)
+        return -1;
+
+    PREEMPT_LOCK;
+    size_t written = fwrite(trace_header, 1, trace_mapping_size, file);
+    PREEMPT_UNLOCK;
+    if (fclose(file) != 0 || written != trace_mapping_size)
+        return -1;
+    return 0;
+}
+
+/* Arrêter l'enregistrement, le fichier éventuel contient alors la trace complète.
+ */
+int thread_trace_stop(void)
+{
+    if (trace_header == NULL)
+        return -1;
+    PREEMPT_LOCK;
+    struct trace_header *header = trace_header;
+    trace_header = NULL;
+    PREEMPT_UNLOCK;
+    return munmap(header, trace_mapping_size);
+}
@@ -1,12 +1,51 @@
 #ifndef __THREAD_H__
 #define __THREAD_H__
 
+#include <stddef.h>
+
+/* statistiques d'ordonnancement d'un thread, cumulées depuis sa création.
+ * les durées sont données en nanosecondes.
+ */
+struct thread_stats
+{
+    unsigned long long cpu_cycles;              /* temps d'exécution en cycles TSC (en ns sans TSC invariant) */
+    unsigned long long cpu_ns;                  /* temps d'exécution */
+    unsigned long long nb_voluntary_switches;   /* passages de main (yield, join, mutex) */
+    unsigned long long nb_involuntary_switches; /* passages de main dus à la préemption */
+    unsigned long long runnable_ns;             /* temps passé prêt mais sans le processeur */
+    unsigned long long mutex_blocked_ns;        /* temps passé bloqué sur un mutex */
+    unsigned long long join_blocked_ns;         /* temps passé bloqué dans thread_join */
+    unsigned long long address_blocked_ns;      /* temps passé bloqué dans thread_wait_on ou thread_park */
+    unsigned long long fd_blocked_ns;           /* temps passé bloqué dans thread_wait_fd */
+};
+
+/* profil de contention d'un mutex, cumulé depuis son initialisation (voir thread_mutex_profile_start).
+ * les cycles sont ceux du TSC (des ns sans TSC invariant).
+ */
+#define THREAD_MUTEX_PROFILE_BUCKETS 32
+struct thread_mutex_profile
+{
+    const char *name;                   /* nom donné par thread_mutex_setname, NULL sinon */
+    void *site;                         /* adresse de retour de l'appel à thread_mutex_init */
+    unsigned long long nb_acquisitions; /* prises du mutex */
+    unsigned long long nb_contended;    /* attentes qui ont abouti à une prise */
+    unsigned long long wait_cycles;     /* temps d'attente total de ces prises */
+    unsigned long long max_wait_cycles; /* plus longue attente */
+    unsigned long long nb_timeouts;     /* attentes de thread_mutex_timedlock expirées */
+    unsigned long long timeout_cycles;  /* temps passé dans ces attentes expirées */
+    unsigned long long hold_cycles;     /* temps de détention total */
+    /* durées de détention: la case i compte celles de 2^i à 2^(i+1) ns, la dernière aussi les plus longues */
+    unsigned long long hold_histogram[THREAD_MUTEX_PROFILE_BUCKETS];
+};
+
 #ifndef USE_PTHREAD
 
 /* identifiant de thread
- * NB: pourra être un entier au lieu d'un pointeur si ca vous arrange,
- *     mais attention aux inconvénients des tableaux de threads
- *     (consommation mémoire, cout d'allocation, ...).
+ * NB: c'est un entier de la taille d'un pointeur: l'indice du thread dans une table de
+ *     descripteurs (32 bits de poids faible) et le numéro de génération de sa case (32 bits de
+ *     poids fort). la génération change quand le thread est joint, ce qui permet de réutiliser
+ *     la case: un identifiant périmé est reconnu (ESRCH) au lieu de désigner un autre thread.
+ *     un identifiant valide n'est jamais NULL.
  */
 typedef void *thread_t;
 
@@ -19,13 +58,59 @@ extern thread_t thread_self(void);
  */
 extern int thread_create(thread_t *newthread, void *(*func)(void *), void *funcarg);
 
+/* attributs de création, NULL pour ceux par défaut
+ */
+typedef struct thread_attr
+{
+    int priority; /* de 0 à 39, 20 par défaut (voir thread_setpriority) */
+} thread_attr_t;
+
+/* creer n threads qui vont exécuter func avec les arguments args[0..n-1] (NULL si args est NULL)
+ * et les placer dans newthreads[0..n-1].
+ * les descripteurs sont alloués d'un seul bloc, rendu quand le dernier thread du groupe est
+ * joint, et les threads sont ajoutés d'un coup à l'ordonnanceur.
+ * renvoie 0 en cas de succès, -1 en cas d'erreur (aucun thread n'est alors créé).
+ */
+extern int thread_create_many(thread_t *newthreads, size_t n, void *(*func)(void *), void *args[], const thread_attr_t *attr);
+
+/* attendre la fin des n threads de threads[], la valeur renvoyée par le i-ème est placée
+ * dans retvals[i]. si retvals est NULL, les valeurs de retour sont ignorées.
+ * renvoie 0, ou la première erreur de thread_join.
+ */
+extern int thread_join_many(thread_t *threads, size_t n, void *retvals[]);
+
 /* passer la main à un autre thread.
  */
 extern int thread_yield(void);
 
+/* passer la main directement au thread donné s'il est prêt, sans passer par l'ordonnanceur
+ * (quand on sait quel thread doit s'exécuter ensuite, par exemple dans un échange requête/réponse).
+ * le temps consommé est compté au thread courant comme par thread_yield. si le thread donné est
+ * le thread courant, bloqué ou terminé, équivaut à thread_yield.
+ * renvoie -1 si thread est NULL, ESRCH si le thread a déjà été joint, 0 sinon.
+ */
+extern int thread_yield_to(thread_t thread);
+
+/* savoir si le thread courant a épuisé sa tranche de temps, pour les boucles de calcul
+ * sans préemption: ce n'est que la lecture d'un drapeau, levé par une minuterie de temps cpu
+ * et baissé à chaque changement de thread (avec la préemption, il reste baissé).
+ */
+extern volatile int thread_yield_pending;
+
+static inline int thread_should_yield(void)
+{
+    return thread_yield_pending;
+}
+
+/* passer la main seulement si la tranche de temps du thread courant est épuisée.
+ */
+#define THREAD_MAYBE_YIELD() do { if (thread_should_yield()) thread_yield(); } while (0)
+
 /* attendre la fin d'exécution d'un thread.
  * la valeur renvoyée par le thread est placée dans *retval.
  * si retval est NULL, la valeur de retour est ignorée.
+ * renvoie 0, -1 si thread est NULL, ESRCH si le thread a déjà été joint,
+ * EDEADLK si l'attente ne finirait jamais.
  */
 extern int thread_join(thread_t thread, void **retval);
 
@@ -55,16 +140,220 @@ extern int thread_getpriority(thread_t thread);
 */
 extern int thread_setpriority(thread_t thread, int priority);
 
+/* Obtenir les statistiques d'ordonnancement du thread donné
+ * (utilisable jusqu'à ce que le thread soit joint).
+ *
+ * retourne 0 si l'exécution n'a levé aucune erreur, -1 sinon
+ */
+extern int thread_getstats(thread_t thread, struct thread_stats *stats);
+
+/* Futures: appels asynchrones
+ *
+ * thread_async lance func(funcarg) dans un nouveau thread et renvoie le future de son résultat
+ * (NULL en cas d'erreur). Le thread ne reçoit sa pile qu'au moment où il est ordonnancé:
+ * si le résultat est demandé avant, func est exécutée directement sur la pile du thread qui
+ * attend, sans allocation de pile.
+ *
+ * thread_future_get attend le résultat, le place dans *retval (si retval n'est pas NULL) et
+ * libère le future. renvoie 0, EINVAL si future est NULL, EDEADLK si on attend son propre future.
+ *
+ * thread_future_wait_for attend au plus timeout_ns nanosecondes que le résultat soit prêt,
+ * sans libérer le future. renvoie 0 s'il est prêt, ETIMEDOUT sinon.
+ *
+ * thread_future_then renvoie le future de func(résultat de future), lancé quand future est
+ * terminé. future est alors libéré automatiquement et ne doit plus être utilisé.
+ * renvoie NULL en cas d'erreur ou si future a déjà une suite.
+ */
+typedef struct thread_future *thread_future_t;
+thread_future_t thread_async(void *(*func)(void *), void *funcarg);
+int thread_future_get(thread_future_t future, void **retval);
+int thread_future_wait_for(thread_future_t future, unsigned long long timeout_ns);
+thread_future_t thread_future_then(thread_future_t future, void *(*func)(void *));
+
+/* Tâches fork-join
+ *
+ * Une tâche est un appel func(arg) bien plus léger qu'un thread: ni thread ni pile ne lui sont
+ * alloués, et sa structure est fournie par l'appelant (sur sa pile le plus souvent).
+ * thread_task_spawn range la tâche dans une file et revient tout de suite.
+ * thread_task_sync attend la fin de la tâche et place son résultat dans *retval (si retval
+ * n'est pas NULL). Si elle n'a pas encore commencé, elle est exécutée directement par le
+ * thread qui synchronise. Sinon c'est un des threads ouvriers, créés au premier
+ * thread_task_spawn, qui l'a prise dans la file pendant que les autres threads passaient la
+ * main ou étaient bloqués: une tâche qui bloque ne bloque que le thread qui l'exécute.
+ * Quand tous les ouvriers sont bloqués dans leur tâche et que des tâches attendent encore
+ * (qui sont peut-être celles qu'ils attendent), un ouvrier de plus est créé, jusqu'à 64.
+ * Chaque tâche doit être synchronisée une fois, avant que sa structure ne disparaisse.
+ * func doit rendre son résultat par return (pas de thread_exit).
+ *
+ * renvoient 0 en cas de succès, EINVAL si task (ou func) est NULL.
+ */
+typedef struct thread_task
+{
+    void *(*func)(void *);
+    void *arg;
+    void *retval;
+    int state;                       /* en attente, en cours ou terminée */
+    struct thread_task *next, *prev; /* file des tâches en attente */
+} thread_task_t;
+int thread_task_spawn(thread_task_t *task, void *(*func)(void *), void *arg);
+int thread_task_sync(thread_task_t *task, void **retval);
+
+/* Groupes de threads réutilisables
+ *
+ * thread_pool_create lance nb_threads threads qui exécutent les travaux soumis, dans l'ordre
+ * de soumission, jusqu'à la destruction du groupe. Au plus queue_size travaux attendent
+ * d'être pris: thread_pool_submit bloque alors jusqu'à ce qu'une place se libère.
+ * Les threads sans travail sont bloqués hors de l'ordonnanceur et ne coûtent rien.
+ * renvoie NULL en cas d'erreur.
+ *
+ * thread_pool_submit ajoute func(arg) à la file du groupe.
+ * thread_pool_wait_all attend la fin de tous les travaux soumis jusque-là.
+ * thread_pool_destroy attend la fin des travaux, termine les threads et libère le groupe.
+ *
+ * renvoient 0 en cas de succès, EINVAL si pool (ou func) est NULL ou si le groupe est
+ * détruit, EDEADLK si un thread du groupe devrait attendre son propre groupe.
+ */
+typedef struct thread_pool *thread_pool_t;
+thread_pool_t thread_pool_create(int nb_threads, int queue_size);
+int thread_pool_submit(thread_pool_t pool, void (*func)(void *), void *arg);
+int thread_pool_wait_all(thread_pool_t pool);
+int thread_pool_destroy(thread_pool_t pool);
+
+/* Données propres à chaque thread
+ *
+ * thread_key_create alloue une clé (au plus THREAD_KEYS_MAX à la fois) dont la valeur vaut
+ * NULL dans tous les threads. Chaque thread y associe sa propre valeur avec thread_setspecific
+ * et la relit en temps constant avec thread_getspecific.
+ * Quand un thread se termine, le destructeur de chaque clé (s'il n'est pas NULL) est appelé
+ * avec la valeur du thread si elle n'est pas NULL.
+ *
+ * renvoient 0 en cas de succès, EAGAIN s'il n'y a plus de clé libre, EINVAL pour une clé
+ * invalide, ENOMEM si la mémoire manque.
+ */
+#define THREAD_KEYS_MAX 128
+typedef unsigned int thread_key_t;
+int thread_key_create(thread_key_t *key, void (*destructor)(void *));
+int thread_key_delete(thread_key_t key);
+int thread_setspecific(thread_key_t key, const void *value);
+void *thread_getspecific(thread_key_t key);
+
+/* Attente sur une adresse, comme futex(2) mais pour les threads de la bibliothèque
+ *
+ * thread_wait_on bloque le thread courant si *addr vaut encore expected (la comparaison et
+ * la mise en attente sont atomiques vis-à-vis des autres threads), jusqu'à un thread_wake
+ * sur la même adresse. Comme avec futex, le réveil ne garantit rien sur *addr: l'appelant
+ * doit relire la valeur et recommencer si besoin.
+ * renvoie 0 après un réveil, EAGAIN si *addr ne valait pas expected.
+ *
+ * thread_timedwait_on fait de même en attendant au plus timeout_ns nanosecondes,
+ * et renvoie ETIMEDOUT si l'échéance est passée sans réveil.
+ *
+ * thread_wake réveille au plus nb_threads threads en attente sur addr, dans l'ordre de
+ * leurs appels à thread_wait_on (INT_MAX pour tous), sans passer la main.
+ * renvoie le nombre de threads réveillés.
+ */
+int thread_wait_on(int *addr, int expected);
+int thread_timedwait_on(int *addr, int expected, unsigned long long timeout_ns);
+int thread_wake(int *addr, int nb_threads);
+
+/* Attente d'un descripteur de fichier
+ *
+ * bloque le thread courant jusqu'à ce que fd soit prêt pour events (POLLIN, POLLOUT... comme
+ * pour poll(2)), sans bloquer les autres threads: quand plus aucun thread n'est prêt,
+ * l'ordonnanceur dort dans epoll_wait jusqu'à ce qu'un descripteur soit prêt ou la première
+ * échéance. un seul thread à la fois peut attendre un même descripteur.
+ * renvoie les événements prêts (éventuellement POLLHUP ou POLLERR), -1 en cas d'erreur (errno).
+ * si fd est fermé pendant l'attente, le thread est réveillé au plus tard 50 ms après avec -1
+ * et errno à EBADF (sauf si le numéro a été réutilisé entre-temps par un autre descripteur).
+ *
+ * si tous les threads sont bloqués sans descripteur ni échéance à attendre, rien ne peut plus
+ * les réveiller: la bibliothèque décrit sur la sortie d'erreur ce que chacun attend et
+ * termine le programme par abort().
+ */
+int thread_wait_fd(int fd, short events);
+
+/* Réveil depuis un autre thread noyau
+ *
+ * thread_wake_external peut être appelée depuis n'importe quel thread noyau, par exemple un
+ * pthread créé par une autre bibliothèque: elle réveille le thread donné s'il est bloqué dans
+ * thread_park, et sinon son prochain appel à thread_park reviendra aussitôt. les réveils sont
+ * pris en compte par lots à chaque passage dans l'ordonnanceur, ou dès leur arrivée quand plus
+ * aucun thread n'est prêt. un handle périmé est ignoré.
+ * renvoie 0, -1 en cas d'erreur (errno).
+ *
+ * thread_park bloque le thread courant jusqu'à un thread_wake_external qui le désigne. comme
+ * pour thread_wait_on, l'appelant doit vérifier la condition attendue et recommencer si besoin.
+ * renvoie 0, -1 en cas d'erreur (errno).
+ */
+int thread_wake_external(thread_t thread);
+int thread_park(void);
+
 /* Interface possible pour les mutex */
+struct mutex_profile;
 typedef struct thread_mutex
 {
-    thread_t *owner;
+    struct thread_struct *owner; /* descripteur du thread qui détient le mutex, NULL s'il est libre */
+    int state;       /* 0 libre, 1 pris, 2 pris avec des threads en attente */
+    unsigned long long contended_since; /* première attente de la détention en cours, 0 sans attente */
+    unsigned long long wait_ewma;       /* moyenne glissante des attentes jusqu'à la libération */
+    struct mutex_profile *profile;      /* NULL si le profil n'était pas actif à l'initialisation */
 } thread_mutex_t;
 int thread_mutex_init(thread_mutex_t *mutex);
 int thread_mutex_destroy(thread_mutex_t *mutex);
 int thread_mutex_lock(thread_mutex_t *mutex);
 int thread_mutex_unlock(thread_mutex_t *mutex);
 
+/* prendre le mutex s'il est libre, sans jamais passer la main.
+ * renvoie 0 si le mutex est pris, EBUSY s'il était déjà détenu.
+ */
+int thread_mutex_trylock(thread_mutex_t *mutex);
+
+/* comme thread_mutex_lock, mais en attendant au plus timeout_ns nanosecondes: à l'échéance,
+ * le thread quitte la file d'attente du mutex et redevient prêt.
+ * renvoie 0 si le mutex est pris, ETIMEDOUT sinon.
+ */
+int thread_mutex_timedlock(thread_mutex_t *mutex, unsigned long long timeout_ns);
+
+/* Profil de contention des mutex (désactivé par défaut)
+ *
+ * thread_mutex_profile_start active le profil des mutex initialisés ensuite: prises, attentes,
+ * temps d'attente et histogramme des durées de détention (voir struct thread_mutex_profile).
+ * Chaque mutex est désigné par le site de son thread_mutex_init, ou par le nom donné avec
+ * thread_mutex_setname (la chaîne est copiée). Le profil d'un mutex détruit est conservé.
+ *
+ * thread_mutex_getprofile copie le profil du mutex dans *profile.
+ *
+ * thread_mutex_profile_dump écrit dans le fichier path (la sortie d'erreur si path est NULL)
+ * les nb_mutexes mutex qui ont le plus attendu, par temps d'attente total décroissant
+ * (tous si nb_mutexes vaut 0).
+ *
+ * Le profil peut aussi être activé sans modifier le programme avec la variable
+ * d'environnement LIBTHREAD_MUTEX_PROFILE=<nb_mutexes>, qui l'écrit sur la sortie d'erreur
+ * à la fin du programme.
+ *
+ * renvoient 0 en cas de succès, -1 en cas d'erreur (mutex non profilé pour les deux premières).
+ */
+int thread_mutex_profile_start(void);
+int thread_mutex_setname(thread_mutex_t *mutex, const char *name);
+int thread_mutex_getprofile(thread_mutex_t *mutex, struct thread_mutex_profile *profile);
+int thread_mutex_profile_dump(const char *path, unsigned int nb_mutexes);
+
+/* Traces d'ordonnancement (désactivées par défaut)
+ *
+ * thread_trace_start enregistre les changements de contexte, créations, terminaisons,
+ * blocages, réveils et préemptions dans un tampon circulaire de nb_events événements
+ * (0 pour la taille par défaut). Si path n'est pas NULL, le tampon est projeté dans ce
+ * fichier, sinon il reste en mémoire jusqu'à un thread_trace_save.
+ * La trace se convertit pour Perfetto / chrome://tracing avec trace_to_json.py.
+ * Elle peut aussi être démarrée sans modifier le programme avec la variable
+ * d'environnement LIBTHREAD_TRACE=<fichier> (et LIBTHREAD_TRACE_EVENTS=<nb_events>).
+ *
+ * renvoient 0 en cas de succès, -1 en cas d'erreur.
+ */
+int thread_trace_start(const char *path, unsigned long nb_events);
+int thread_trace_save(const char *path);
+int thread_trace_stop(void);
+
 #else /* USE_PTHREAD */
 
 /* Si on compile avec -DUSE_PTHREAD, ce sont les pthreads qui sont utilisés */
@@ -74,6 +363,10 @@ int thread_mutex_unlock(thread_mutex_t *mutex);
 #define thread_self pthread_self
 #define thread_create(th, func, arg) pthread_create(th, NULL, func, arg)
 #define thread_yield sched_yield
+#define thread_yield_to(thread) ((void)(thread), sched_yield())
+/* le noyau préempte les pthreads: pas besoin de passer la main dans les boucles de calcul */
+#define thread_should_yield() 0
+#define THREAD_MAYBE_YIELD() do { } while (0)
 #define thread_join pthread_join
 #define thread_exit pthread_exit
 
@@ -81,12 +374,383 @@ int thread_mutex_unlock(thread_mutex_t *mutex);
 #define thread_setpriority pthread_setschedprio
 #define thread_getpriority pthread_getschedprio
 
+/* Création et attente groupées: une boucle sur pthread_create et pthread_join, sans priorité */
+typedef struct thread_attr
+{
+    int priority;
+} thread_attr_t;
+
+static inline int thread_join_many(pthread_t *threads, size_t n, void *retvals[])
+{
+    size_t i;
+    int err, first_err = 0;
+    for (i = 0; i < n; i++) {
+        err = pthread_join(threads[i], retvals != NULL ? &retvals[i] : NULL);
+        if (err != 0 && first_err == 0)
+            first_err = err;
+    }
+    return first_err;
+}
+
+static inline int thread_create_many(pthread_t *newthreads, size_t n, void *(*func)(void *), void *args[], const thread_attr_t *attr)
+{
+    size_t i;
+    (void)attr;
+    for (i = 0; i < n; i++) {
+        if (pthread_create(&newthreads[i], NULL, func, args != NULL ? args[i] : NULL) != 0) {
+            thread_join_many(newthreads, i, NULL);
+            return -1;
+        }
+    }
+    return 0;
+}
+
+/* Statistiques : seul le temps CPU est fourni par les pthreads (nécessite POSIX.1-2001) */
+#if _POSIX_C_SOURCE >= 200112L
+#include <string.h>
+#include <time.h>
+static inline int thread_getstats(pthread_t thread, struct thread_stats *stats)
+{
+    clockid_t clock;
+    struct timespec ts;
+    if (stats == NULL || pthread_getcpuclockid(thread, &clock) != 0 || clock_gettime(clock, &ts) != 0)
+        return -1;
+    memset(stats, 0, sizeof(*stats));
+    stats->cpu_ns = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+    return 0;
+}
+#endif
+
+/* Futures: un pthread par appel, thread_future_then joint le précédent avant d'appeler func */
+#include <errno.h>
+#include <stdlib.h>
+struct thread_future
+{
+    pthread_t thread;
+    void *(*func)(void *);
+    void *arg;
+    struct thread_future *parent;
+    int done;
+};
+typedef struct thread_future *thread_future_t;
+
+static inline void *thread_future_run(void *arg)
+{
+    struct thread_future *future = (struct thread_future *)arg;
+    void *retval;
+    if (future->parent != NULL) {
+        pthread_join(future->parent->thread, &future->arg);
+        free(future->parent);
+    }
+    retval = future->func(future->arg);
+    __atomic_store_n(&future->done, 1, __ATOMIC_RELEASE);
+    return retval;
+}
+
+static inline thread_future_t thread_future_start(void *(*func)(void *), void *arg, struct thread_future *parent)
+{
+    struct thread_future *future = (struct thread_future *)malloc(sizeof(*future));
+    if (future == NULL)
+        return NULL;
+    future->func = func;
+    future->arg = arg;
+    future->parent = parent;
+    future->done = 0;
+    if (pthread_create(&future->thread, NULL, thread_future_run, future) != 0) {
+        free(future);
+        return NULL;
+    }
+    return future;
+}
+
+static inline thread_future_t thread_async(void *(*func)(void *), void *funcarg)
+{
+    return thread_future_start(func, funcarg, NULL);
+}
+
+static inline thread_future_t thread_future_then(thread_future_t future, void *(*func)(void *))
+{
+    return future == NULL ? NULL : thread_future_start(func, NULL, future);
+}
+
+static inline int thread_future_get(thread_future_t future, void **retval)
+{
+    int err;
+    if (future == NULL)
+        return EINVAL;
+    err = pthread_join(future->thread, retval);
+    if (!err)
+        free(future);
+    return err;
+}
+
+#if _POSIX_C_SOURCE >= 200112L
+static inline int thread_future_wait_for(thread_future_t future, unsigned long long timeout_ns)
+{
+    struct timespec start, now;
+    if (future == NULL)
+        return EINVAL;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while (!__atomic_load_n(&future->done, __ATOMIC_ACQUIRE)) {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        if ((now.tv_sec - start.tv_sec) * 1000000000ULL + now.tv_nsec - start.tv_nsec >= timeout_ns)
+            return ETIMEDOUT;
+        sched_yield();
+    }
+    return 0;
+}
+#endif
+
+/* Tâches fork-join: un pthread par tâche */
+typedef struct thread_task
+{
+    pthread_t thread;
+} thread_task_t;
+
+static inline int thread_task_spawn(thread_task_t *task, void *(*func)(void *), void *arg)
+{
+    return task == NULL ? EINVAL : pthread_create(&task->thread, NULL, func, arg);
+}
+
+static inline int thread_task_sync(thread_task_t *task, void **retval)
+{
+    return task == NULL ? EINVAL : pthread_join(task->thread, retval);
+}
+
+/* Groupes de threads: la file est protégée par un mutex et trois conditions */
+struct thread_pool
+{
+    pthread_t *workers;
+    int nb_workers;
+    struct { void (*func)(void *); void *arg; } *jobs;
+    int queue_size, head, nb_queued, nb_unfinished, stopping;
+    pthread_mutex_t lock;
+    pthread_cond_t not_empty, not_full, all_done;
+};
+typedef struct thread_pool *thread_pool_t;
+
+static inline void *thread_pool_worker(void *arg)
+{
+    struct thread_pool *pool = (struct thread_pool *)arg;
+    pthread_mutex_lock(&pool->lock);
+    while (1) {
+        void (*func)(void *);
+        void *funcarg;
+        while (pool->nb_queued == 0 && !pool->stopping)
+            pthread_cond_wait(&pool->not_empty, &pool->lock);
+        if (pool->nb_queued == 0)
+            break;
+        func = pool->jobs[pool->head].func;
+        funcarg = pool->jobs[pool->head].arg;
+        pool->head = (pool->head + 1) % pool->queue_size;
+        pool->nb_queued--;
+        pthread_cond_signal(&pool->not_full);
+        pthread_mutex_unlock(&pool->lock);
+        func(funcarg);
+        pthread_mutex_lock(&pool->lock);
+        if (--pool->nb_unfinished == 0)
+            pthread_cond_broadcast(&pool->all_done);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return NULL;
+}
+
+/* un thread du groupe qui attendrait son propre groupe ne serait jamais réveillé */
+static inline int thread_pool_is_worker(thread_pool_t pool)
+{
+    int i;
+    for (i = 0; i < pool->nb_workers; i++)
+        if (pthread_equal(pool->workers[i], pthread_self()))
+            return 1;
+    return 0;
+}
+
+static inline int thread_pool_wait_all(thread_pool_t pool)
+{
+    if (pool == NULL)
+        return EINVAL;
+    if (thread_pool_is_worker(pool))
+        return EDEADLK;
+    pthread_mutex_lock(&pool->lock);
+    while (pool->nb_unfinished > 0)
+        pthread_cond_wait(&pool->all_done, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+static inline int thread_pool_destroy(thread_pool_t pool)
+{
+    int i;
+    if (pool == NULL)
+        return EINVAL;
+    thread_pool_wait_all(pool);
+    pthread_mutex_lock(&pool->lock);
+    pool->stopping = 1;
+    pthread_cond_broadcast(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    for (i = 0; i < pool->nb_workers; i++)
+        pthread_join(pool->workers[i], NULL);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->not_empty);
+    pthread_cond_destroy(&pool->not_full);
+    pthread_cond_destroy(&pool->all_done);
+    free(pool->workers);
+    free(pool->jobs);
+    free(pool);
+    return 0;
+}
+
+static inline thread_pool_t thread_pool_create(int nb_threads, int queue_size)
+{
+    struct thread_pool *pool;
+    if (nb_threads <= 0 || queue_size <= 0)
+        return NULL;
+    pool = (struct thread_pool *)calloc(1, sizeof(*pool));
+    if (pool == NULL)
+        return NULL;
+    pool->workers = (pthread_t *)malloc(nb_threads * sizeof(*pool->workers));
+    pool->jobs = malloc(queue_size * sizeof(*pool->jobs));
+    if (pool->workers == NULL || pool->jobs == NULL) {
+        free(pool->workers);
+        free(pool->jobs);
+        free(pool);
+        return NULL;
+    }
+    pool->queue_size = queue_size;
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->not_empty, NULL);
+    pthread_cond_init(&pool->not_full, NULL);
+    pthread_cond_init(&pool->all_done, NULL);
+    while (pool->nb_workers < nb_threads) {
+        if (pthread_create(&pool->workers[pool->nb_workers], NULL, thread_pool_worker, pool) != 0) {
+            thread_pool_destroy(pool);
+            return NULL;
+        }
+        pool->nb_workers++;
+    }
+    return pool;
+}
+
+static inline int thread_pool_submit(thread_pool_t pool, void (*func)(void *), void *arg)
+{
+    int slot;
+    if (pool == NULL || func == NULL)
+        return EINVAL;
+    pthread_mutex_lock(&pool->lock);
+    if (pool->stopping) {
+        pthread_mutex_unlock(&pool->lock);
+        return EINVAL;
+    }
+    while (pool->nb_queued == pool->queue_size) {
+        if (thread_pool_is_worker(pool)) {
+            pthread_mutex_unlock(&pool->lock);
+            return EDEADLK;
+        }
+        pthread_cond_wait(&pool->not_full, &pool->lock);
+    }
+    slot = (pool->head + pool->nb_queued) % pool->queue_size;
+    pool->jobs[slot].func = func;
+    pool->jobs[slot].arg = arg;
+    pool->nb_queued++;
+    pool->nb_unfinished++;
+    pthread_cond_signal(&pool->not_empty);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+}
+
+/* Données propres à chaque thread */
+#include <limits.h>
+#define THREAD_KEYS_MAX PTHREAD_KEYS_MAX
+#define thread_key_t pthread_key_t
+#define thread_key_create pthread_key_create
+#define thread_key_delete pthread_key_delete
+#define thread_setspecific pthread_setspecific
+#define thread_getspecific pthread_getspecific
+
+/* Attente sur une adresse: l'appel système futex (nécessite _DEFAULT_SOURCE ou _GNU_SOURCE) */
+#if defined(_DEFAULT_SOURCE) || defined(_GNU_SOURCE)
+#include <errno.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+static inline int thread_wait_on(int *addr, int expected)
+{
+    if (syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, NULL, NULL, 0) == -1 && errno == EAGAIN)
+        return EAGAIN;
+    return 0;
+}
+static inline int thread_timedwait_on(int *addr, int expected, unsigned long long timeout_ns)
+{
+    struct timespec timeout = { (time_t)(timeout_ns / 1000000000ULL), (long)(timeout_ns % 1000000000ULL) };
+    if (syscall(SYS_futex, addr, FUTEX_WAIT_PRIVATE, expected, &timeout, NULL, 0) == -1 &&
+        (errno == EAGAIN || errno == ETIMEDOUT))
+        return errno;
+    return 0;
+}
+static inline int thread_wake(int *addr, int nb_threads)
+{
+    return syscall(SYS_futex, addr, FUTEX_WAKE_PRIVATE, nb_threads, NULL, NULL, 0);
+}
+#endif
+
+/* Réveil depuis un autre thread noyau: sans jeton par thread, thread_park ne fait que passer la main
+ * et peut revenir sans réveil, ce que l'appelant doit déjà accepter */
+static inline int thread_wake_external(pthread_t thread)
+{
+    (void)thread;
+    return 0;
+}
+static inline int thread_park(void)
+{
+    return sched_yield();
+}
+
+/* Attente d'un descripteur de fichier: poll(2) ne bloque que le thread appelant */
+#include <poll.h>
+static inline int thread_wait_fd(int fd, short events)
+{
+    struct pollfd pfd = { fd, events, 0 };
+    if (poll(&pfd, 1, -1) == -1)
+        return -1;
+    if (pfd.revents & POLLNVAL) {
+        errno = EBADF;
+        return -1;
+    }
+    return pfd.revents;
+}
+
 /* Interface possible pour les mutex */
 #define thread_mutex_t pthread_mutex_t
 #define thread_mutex_init(_mutex) pthread_mutex_init(_mutex, NULL)
 #define thread_mutex_destroy pthread_mutex_destroy
 #define thread_mutex_lock pthread_mutex_lock
 #define thread_mutex_unlock pthread_mutex_unlock
+#define thread_mutex_trylock pthread_mutex_trylock
+#if _POSIX_C_SOURCE >= 200112L
+/* pthread_mutex_timedlock attend une échéance absolue sur CLOCK_REALTIME (nécessite POSIX.1-2001) */
+static inline int thread_mutex_timedlock(pthread_mutex_t *mutex, unsigned long long timeout_ns)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += timeout_ns / 1000000000ULL;
+    deadline.tv_nsec += timeout_ns % 1000000000ULL;
+    if (deadline.tv_nsec >= 1000000000L) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000L;
+    }
+    return pthread_mutex_timedlock(mutex, &deadline);
+}
+#endif
+
+/* Pas de profil des mutex ni de traces d'ordonnancement avec les pthreads */
+#define thread_mutex_profile_start() (-1)
+#define thread_mutex_setname(mutex, name) ((void)(mutex), (void)(name), -1)
+#define thread_mutex_getprofile(mutex, profile) ((void)(mutex), (void)(profile), -1)
+#define thread_mutex_profile_dump(path, nb_mutexes) (-1)
+#define thread_trace_start(path, nb_events) (-1)
+#define thread_trace_save(path) (-1)
+#define thread_trace_stop() (-1)
 
 
 #endif /* USE_PTHREAD */
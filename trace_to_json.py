@@ -0,0 +1,88 @@
+#!/bin/env python3
+
+# Converts a scheduling trace recorded by libthread (thread_trace_start or LIBTHREAD_TRACE=<file>)
+# into the Chrome trace event JSON format, readable by https://ui.perfetto.dev or chrome://tracing
+
+import json
+import struct
+import sys
+
+HEADER_FORMAT = "<8sIIQQQd16x"
+EVENT_FORMAT = "<QIIII"
+
+EVENT_NAMES = ["switch", "create", "exit", "block", "wake", "preempt"]
+WAIT_REASONS = ["runnable", "mutex", "join", "address", "fd", "park"]
+SWITCH, CREATE, EXIT, BLOCK, WAKE, PREEMPT = range(len(EVENT_NAMES))
+
+
+def read_trace(path):
+    with open(path, "rb") as f:
+        data = f.read()
+    header_size = struct.calcsize(HEADER_FORMAT)
+    magic, version, event_size, nb_events, head, start_ticks, ns_per_tick = \
+        struct.unpack_from(HEADER_FORMAT, data)
+    if magic != b"THRTRACE" or version != 1 or event_size != struct.calcsize(EVENT_FORMAT):
+        print(f"{path} is not a libthread trace (version 1)")
+        sys.exit(1)
+
+    # when the ring buffer wrapped, the oldest event is the one at head
+    first = max(0, head - nb_events)
+    events = []
+    for i in range(first, head):
+        offset = header_size + (i % nb_events) * event_size
+        events.append(struct.unpack_from(EVENT_FORMAT, data, offset))
+    return start_ticks, ns_per_tick, events, head - first != head
+
+
+def to_chrome_trace(start_ticks, ns_per_tick, events):
+    def us(ticks):
+        return (ticks - start_ticks) * ns_per_tick / 1000
+
+    output = []
+    threads = set()
+    running = None  # (thread id, start of its slice)
+    for ticks, type, thread, arg, reason in events:
+        threads.add(thread)
+        if type == SWITCH:
+            if running is None:  # the first thread has been running since the beginning of the trace
+                running = (thread, events[0][0])
+            if running[0] == thread:
+                output.append({"name": "running", "ph": "X", "pid": 1, "tid": thread,
+                               "ts": us(running[1]), "dur": us(ticks) - us(running[1])})
+            running = (arg, ticks)
+            threads.add(arg)
+        else:
+            args = {}
+            if type in (CREATE, WAKE):
+                args["thread"] = arg
+            elif type == BLOCK:
+                args["on"] = arg
+                args["reason"] = WAIT_REASONS[reason]
+            output.append({"name": EVENT_NAMES[type], "ph": "i", "s": "t", "pid": 1, "tid": thread,
+                           "ts": us(ticks), "args": args})
+
+    if running is not None and events:
+        output.append({"name": "running", "ph": "X", "pid": 1, "tid": running[0],
+                       "ts": us(running[1]), "dur": us(events[-1][0]) - us(running[1])})
+    for thread in sorted(threads):
+        output.append({"name": "thread_name", "ph": "M", "pid": 1, "tid": thread,
+                       "args": {"name": "main" if thread == 1 else f"thread {thread}"}})
+    return {"traceEvents": output, "displayTimeUnit": "ns"}
+
+
+def main():
+    if len(sys.argv) < 2:
+        print("Usage: python3 trace_to_json.py <trace_file> [output.json]")
+        sys.exit(1)
+    start_ticks, ns_per_tick, events, wrapped = read_trace(sys.argv[1])
+    if wrapped:
+        print("warning: the ring buffer wrapped, only the last events are kept", file=sys.stderr)
+    trace = to_chrome_trace(start_ticks, ns_per_tick, events)
+    if len(sys.argv) > 2:
+        with open(sys.argv[2], "w") as f:
+            json.dump(trace, f)
+    else:
+        json.dump(trace, sys.stdout)
+
+
+main()
@@ -0,0 +1,150 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "../src/thread.h"
+
+/* test des statistiques d'ordonnancement.
+ *
+ * un thread calcule beaucoup, l'autre passe son temps à rendre la main à un partenaire qui la
+ * lui rend aussitôt (thread_yield peut laisser la main au même thread, thread_yield_to non).
+ * le temps CPU du premier doit être nettement supérieur à celui du second, qui doit compter
+ * au moins NB_YIELDS passages de main et du temps passé prêt.
+ * un troisième thread joint celui qui calcule pendant qu'il tourne encore, et un quatrième
+ * attend un mutex gardé par le main: leur temps bloqué doit être compté.
+ * valgrind doit être content.
+ *
+ * support nécessaire:
+ * - thread_create()
+ * - thread_yield() depuis ou vers le main, thread_yield_to()
+ * - thread_join()
+ * - thread_mutex_lock(), thread_mutex_unlock()
+ * - thread_getstats()
+ */
+
+#define NB_YIELDS 50
+
+static struct thread_stats stats[4];
+static volatile unsigned long sink = 0;
+static volatile int busy_started = 0, locking = 0;
+static thread_t busy_thread, lazy_thread, partner_thread;
+static thread_mutex_t lock;
+
+static void * busy(void *arg)
+{
+  unsigned long i;
+  int err;
+  busy_started = 1;
+  for(i=0; i<50000000; i++) {
+    sink += i;
+    if (i % 1000000 == 0)
+      thread_yield();
+  }
+  err = thread_getstats(thread_self(), &stats[(unsigned long) arg]);
+  assert(!err);
+  return NULL;
+}
+
+static void * lazy(void *arg)
+{
+  int i, err;
+  for(i=0; i<NB_YIELDS; i++)
+    thread_yield_to(partner_thread);
+  err = thread_getstats(thread_self(), &stats[(unsigned long) arg]);
+  assert(!err);
+  return NULL;
+}
+
+static void * partner(void *arg)
+{
+  int i;
+  for(i=0; i<NB_YIELDS; i++)
+    thread_yield_to(lazy_thread);
+  return arg;
+}
+
+static void * joiner(void *arg)
+{
+  int err;
+  while (!busy_started)
+    thread_yield();
+  err = thread_join(busy_thread, NULL);
+  assert(!err);
+  err = thread_getstats(thread_self(), &stats[(unsigned long) arg]);
+  assert(!err);
+  return NULL;
+}
+
+static void * locker(void *arg)
+{
+  int err;
+  locking = 1;
+  thread_mutex_lock(&lock);
+  thread_mutex_unlock(&lock);
+  err = thread_getstats(thread_self(), &stats[(unsigned long) arg]);
+  assert(!err);
+  return NULL;
+}
+
+int main()
+{
+  thread_t th[5];
+  int err, i;
+
+  thread_mutex_init(&lock);
+  thread_mutex_lock(&lock);
+  err = thread_create(&th[0], busy, (void*)0UL);
+  assert(!err);
+  busy_thread = th[0];
+  err = thread_create(&th[1], lazy, (void*)1UL);
+  assert(!err);
+  lazy_thread = th[1];
+  err = thread_create(&th[4], partner, NULL);
+  assert(!err);
+  partner_thread = th[4];
+  err = thread_create(&th[2], joiner, (void*)2UL);
+  assert(!err);
+  err = thread_create(&th[3], locker, (void*)3UL);
+  assert(!err);
+  while (!locking)
+    thread_yield();
+  for(i=0; i<NB_YIELDS; i++)
+    thread_yield();
+  thread_mutex_unlock(&lock);
+
+  /* le thread de calcul est joint par joiner */
+  for(i=1; i<5; i++) {
+    err = thread_join(th[i], NULL);
+    assert(!err);
+  }
+  thread_mutex_destroy(&lock);
+
+  for(i=0; i<4; i++) {
+    printf("thread %d: cpu %llu ns (%llu cycles), switchs %llu/%llu, prêt %llu ns, mutex %llu ns, join %llu ns, adresse %llu ns\n",
+           i, stats[i].cpu_ns, stats[i].cpu_cycles,
+           stats[i].nb_voluntary_switches, stats[i].nb_involuntary_switches,
+           stats[i].runnable_ns, stats[i].mutex_blocked_ns, stats[i].join_blocked_ns,
+           stats[i].address_blocked_ns);
+  }
+
+  if (stats[0].cpu_ns <= stats[1].cpu_ns) {
+    printf("le thread de calcul n'a pas consommé plus de CPU (FAILED)\n");
+    return EXIT_FAILURE;
+  }
+#ifndef USE_PTHREAD
+  /* avec les pthreads, seul le temps CPU est connu */
+  if (stats[1].nb_voluntary_switches < NB_YIELDS || stats[1].runnable_ns == 0) {
+    printf("le thread qui rend la main: %llu passages de main, prêt %llu ns (FAILED)\n",
+           stats[1].nb_voluntary_switches, stats[1].runnable_ns);
+    return EXIT_FAILURE;
+  }
+  if (stats[2].join_blocked_ns == 0 || stats[3].mutex_blocked_ns == 0) {
+    printf("temps bloqué: join %llu ns, mutex %llu ns (FAILED)\n",
+           stats[2].join_blocked_ns, stats[3].mutex_blocked_ns);
+    return EXIT_FAILURE;
+  }
+#endif
+  printf("statistiques OK\n");
+  return EXIT_SUCCESS;
+}
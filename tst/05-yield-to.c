@@ -0,0 +1,72 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include "../src/thread.h"
+
+/* test du passage de main dirigé.
+ *
+ * le main passe la main au dernier thread créé, qui la passe au premier, qui la passe
+ * au deuxième: ils doivent s'exécuter dans cet ordre et non dans l'ordre de création.
+ * passer la main à soi-même équivaut à thread_yield.
+ * le programme doit retourner correctement.
+ * valgrind doit être content.
+ *
+ * support nécessaire:
+ * - thread_create()
+ * - thread_yield_to()
+ * - thread_join()
+ */
+
+#define NB_THREADS 3
+
+static thread_t th[NB_THREADS];
+static int order[NB_THREADS];
+static int nb_run = 0;
+
+static void * thfunc(void *arg)
+{
+  int me = (int)(long) arg;
+  int err;
+
+  order[nb_run++] = me;
+  if (me == NB_THREADS - 1)
+    err = thread_yield_to(th[0]);
+  else if (me == 0)
+    err = thread_yield_to(th[1]);
+  else
+    err = thread_yield_to(thread_self());
+  assert(!err);
+  return arg;
+}
+
+int main()
+{
+  void *res;
+  long i;
+  int err;
+
+  for(i=0; i<NB_THREADS; i++) {
+    err = thread_create(&th[i], thfunc, (void*) i);
+    assert(!err);
+  }
+
+  err = thread_yield_to(th[NB_THREADS - 1]);
+  assert(!err);
+
+  for(i=0; i<NB_THREADS; i++) {
+    err = thread_join(th[i], &res);
+    assert(!err);
+    assert(res == (void*) i);
+  }
+
+#ifndef USE_PTHREAD
+  /* l'ordre n'est garanti que sans préemption */
+  if (order[0] != NB_THREADS - 1 || order[1] != 0 || order[2] != 1) {
+    printf("ordre %d %d %d au lieu de %d 0 1 (FAILED)\n", order[0], order[1], order[2], NB_THREADS - 1);
+    return EXIT_FAILURE;
+  }
+#endif
+
+  printf("%d threads exécutés dans l'ordre des passages de main\n", nb_run);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,67 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include "../src/thread.h"
+
+/* test des identifiants de threads déjà joints.
+ *
+ * un thread joint ne peut plus être désigné: joindre son identifiant une seconde fois,
+ * ou lui passer la main, doit échouer, y compris quand un nouveau thread a repris sa case
+ * de la table des descripteurs. le nouveau thread doit avoir un identifiant différent,
+ * et thread_self doit renvoyer celui donné par thread_create.
+ * valgrind doit être content.
+ *
+ * support nécessaire:
+ * - thread_create(), thread_self()
+ * - thread_join()
+ * - thread_yield_to()
+ */
+
+static void * thfunc(void *arg)
+{
+  (void) arg;
+  return (void *) thread_self();
+}
+
+int main()
+{
+  thread_t old, new;
+  void *res;
+  int err;
+
+  err = thread_create(&old, thfunc, NULL);
+  assert(!err);
+  err = thread_join(old, &res);
+  assert(!err);
+  if (res != (void *) old) {
+    printf("thread_self ne renvoie pas l'identifiant de thread_create (FAILED)\n");
+    return EXIT_FAILURE;
+  }
+
+  err = thread_create(&new, thfunc, NULL);
+  assert(!err);
+#ifndef USE_PTHREAD
+  /* pthread réutilise les identifiants, et joindre deux fois un pthread est indéfini */
+  if (new == old) {
+    printf("un identifiant a été réutilisé (FAILED)\n");
+    return EXIT_FAILURE;
+  }
+  err = thread_join(old, NULL);
+  if (err != ESRCH) {
+    printf("join d'un thread déjà joint a renvoyé %d au lieu de ESRCH (FAILED)\n", err);
+    return EXIT_FAILURE;
+  }
+  err = thread_yield_to(old);
+  if (err != ESRCH) {
+    printf("yield_to d'un thread déjà joint a renvoyé %d au lieu de ESRCH (FAILED)\n", err);
+    return EXIT_FAILURE;
+  }
+#endif
+
+  err = thread_join(new, &res);
+  assert(!err && res == (void *) new);
+
+  printf("les identifiants des threads joints sont bien périmés\n");
+  return EXIT_SUCCESS;
+}
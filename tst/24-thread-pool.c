@@ -0,0 +1,99 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <sys/time.h>
+#include "../src/thread.h"
+
+/* test d'un groupe de threads réutilisable.
+ *
+ * on soumet le nombre de travaux donné en argument à un petit groupe dont la file est
+ * plus courte que le nombre de travaux (la soumission doit donc attendre), deux fois
+ * de suite avec le même groupe, et on vérifie que chaque travail a été exécuté une fois.
+ * la durée du programme doit etre proportionnelle au nombre de travaux donnés en argument,
+ * et bien plus courte qu'avec un create-join par travail (21-create-many).
+ * un travail qui attend son propre groupe doit obtenir EDEADLK au lieu de bloquer.
+ * valgrind doit etre content.
+ *
+ * support nécessaire:
+ * - thread_pool_create(), thread_pool_destroy()
+ * - thread_pool_submit()
+ * - thread_pool_wait_all()
+ * - thread_yield()
+ * - thread_mutex_lock(), thread_mutex_unlock()
+ */
+
+#define NB_WORKERS 4
+#define QUEUE_SIZE 16
+
+static thread_mutex_t lock;
+static unsigned long sum = 0;
+static thread_pool_t pool;
+static int own_wait_err = 0;
+
+static void job(void *arg)
+{
+  unsigned long value = (unsigned long) arg;
+  /* certains travaux passent la main au milieu */
+  if (value % 8 == 0)
+    thread_yield();
+  thread_mutex_lock(&lock);
+  sum += value;
+  thread_mutex_unlock(&lock);
+}
+
+static void wait_own_pool(void *arg __attribute__((unused)))
+{
+  own_wait_err = thread_pool_wait_all(pool);
+}
+
+int main(int argc, char *argv[])
+{
+  struct timeval tv1, tv2;
+  unsigned long us, i, nb, round;
+  int err;
+
+  if (argc < 2) {
+    printf("argument manquant: nombre de travaux\n");
+    return -1;
+  }
+
+  nb = atoi(argv[1]);
+  err = thread_mutex_init(&lock);
+  assert(!err);
+  pool = thread_pool_create(NB_WORKERS, QUEUE_SIZE);
+  assert(pool != NULL);
+
+  gettimeofday(&tv1, NULL);
+  for(round=1; round<=2; round++) {
+    for(i=1; i<=nb; i++) {
+      err = thread_pool_submit(pool, job, (void*) i);
+      assert(!err);
+    }
+    err = thread_pool_wait_all(pool);
+    assert(!err);
+    if (sum != round * nb * (nb + 1) / 2) {
+      printf("somme %lu au lieu de %lu au tour %lu (FAILED)\n", sum, round * nb * (nb + 1) / 2, round);
+      return EXIT_FAILURE;
+    }
+  }
+  gettimeofday(&tv2, NULL);
+
+  /* un travail qui attend son propre groupe */
+  err = thread_pool_submit(pool, wait_own_pool, NULL);
+  assert(!err);
+  err = thread_pool_wait_all(pool);
+  assert(!err);
+  if (own_wait_err != EDEADLK) {
+    printf("attendre son propre groupe a renvoyé %d au lieu de EDEADLK (FAILED)\n", own_wait_err);
+    return EXIT_FAILURE;
+  }
+
+  err = thread_pool_destroy(pool);
+  assert(!err);
+  thread_mutex_destroy(&lock);
+
+  us = (tv2.tv_sec-tv1.tv_sec)*1000000+(tv2.tv_usec-tv1.tv_usec);
+  printf("%lu travaux exécutés par %d threads en %lu us\n", 2 * nb, NB_WORKERS, us);
+  return 0;
+}
@@ -0,0 +1,88 @@
+#include <stdio.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <sys/time.h>
+#include "../src/thread.h"
+
+/* test de plein de create groupés, puis d'un join groupé quand ils ont tous fini
+ *
+ * comme 23-create-many-once, mais avec un seul appel pour créer les threads (en deux
+ * groupes, le second étant créé alors que le premier est encore là) et un seul pour
+ * les joindre. chaque thread renvoie son argument, qui doit être retrouvé au join.
+ * valgrind doit etre content.
+ * la durée du programme doit etre proportionnelle au nombre de threads donnés en argument.
+ *
+ * support nécessaire:
+ * - thread_create_many()
+ * - thread_yield()
+ * - thread_join_many() avec récupération de la valeur de retour
+ */
+
+static void * thfunc(void *arg)
+{
+  thread_yield();
+  return arg;
+}
+
+int main(int argc, char *argv[])
+{
+  thread_t *th;
+  void **args, **res;
+  thread_attr_t attr;
+  int err, i, nb, half;
+  struct timeval tv1, tv2;
+  unsigned long us;
+
+  if (argc < 2) {
+    printf("argument manquant: nombre de threads\n");
+    return -1;
+  }
+
+  nb = atoi(argv[1]);
+  half = nb / 2;
+
+  th = malloc(nb*sizeof(*th));
+  args = malloc(nb*sizeof(*args));
+  res = malloc(nb*sizeof(*res));
+  if (!th || !args || !res) {
+    perror("malloc");
+    return -1;
+  }
+  for(i=0; i<nb; i++)
+    args[i] = (void*)(unsigned long) i;
+  attr.priority = 20;
+
+  gettimeofday(&tv1, NULL);
+
+  /* on cree tous les threads, en deux groupes */
+  err = thread_create_many(th, half, thfunc, args, NULL);
+  assert(!err);
+  err = thread_create_many(th + half, nb - half, thfunc, args + half, &attr);
+  assert(!err);
+
+  /* on leur passe la main, ils vont tous terminer */
+  for(i=0; i<nb; i++) {
+    thread_yield();
+  }
+
+  /* on les joint tous */
+  err = thread_join_many(th, nb, res);
+  assert(!err);
+
+  gettimeofday(&tv2, NULL);
+  us = (tv2.tv_sec-tv1.tv_sec)*1000000+(tv2.tv_usec-tv1.tv_usec);
+
+  for(i=0; i<nb; i++) {
+    if (res[i] != args[i]) {
+      printf("le thread %d a renvoyé %p (FAILED)\n", i, res[i]);
+      return EXIT_FAILURE;
+    }
+  }
+
+  free(th);
+  free(args);
+  free(res);
+
+  printf("%d threads créés et détruits par groupes en %lu us\n", nb, us);
+  return 0;
+}
@@ -0,0 +1,41 @@
+#include <stdio.h>
+#include <assert.h>
+#include "../src/thread.h"
+
+/* test de la fin du main par thread_exit alors que des threads créés d'un coup tournent encore.
+ *
+ * le main crée NB_THREADS threads avec thread_create_many puis appelle thread_exit:
+ * les threads doivent tous s'exécuter, et le programme doit terminer correctement quand
+ * le dernier a fini (son descripteur fait partie du bloc alloué par thread_create_many).
+ * valgrind doit être content.
+ *
+ * support nécessaire:
+ * - thread_create_many()
+ * - thread_yield()
+ * - thread_exit() dans le main
+ */
+
+#define NB_THREADS 4
+
+static int nb_done = 0;
+
+static void * thfunc(void *arg)
+{
+  thread_yield();
+  if (__atomic_add_fetch(&nb_done, 1, __ATOMIC_RELAXED) == NB_THREADS)
+    printf("%d threads terminés après le main\n", NB_THREADS);
+  return arg;
+}
+
+int main()
+{
+  thread_t th[NB_THREADS];
+  void *args[NB_THREADS] = { NULL };
+  int err;
+
+  err = thread_create_many(th, NB_THREADS, thfunc, args, NULL);
+  assert(!err);
+
+  thread_exit(NULL);
+  return 0; /* unreachable, shut up the compiler */
+}
@@ -0,0 +1,113 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <assert.h>
+#include "../src/thread.h"
+
+/* test des données propres à chaque thread.
+ *
+ * chaque thread range son numéro dans une clé, passe la main plusieurs fois
+ * puis vérifie qu'il relit bien sa propre valeur.
+ * le destructeur de la clé doit être appelé une fois par thread qui a une valeur.
+ * une clé recréée après sa destruction doit valoir NULL partout.
+ * valgrind doit être content.
+ *
+ * support nécessaire:
+ * - thread_create()
+ * - thread_yield() depuis ou vers le main
+ * - thread_join()
+ * - thread_key_create(), thread_key_delete()
+ * - thread_setspecific(), thread_getspecific()
+ * - thread_mutex_lock(), thread_mutex_unlock()
+ */
+
+#define NB_THREADS 20
+#define NB_YIELDS 10
+
+static thread_key_t key;
+static int nb_destructions = 0;
+static unsigned long sum_destroyed = 0;
+static thread_mutex_t lock;
+
+static void destructor(void *value)
+{
+  thread_mutex_lock(&lock);
+  nb_destructions++;
+  sum_destroyed += *(unsigned long *) value;
+  thread_mutex_unlock(&lock);
+  free(value);
+}
+
+static void * thfunc(void *arg)
+{
+  unsigned long me = (unsigned long) arg;
+  int i, err;
+
+  assert(thread_getspecific(key) == NULL);
+
+  /* les threads impairs ne mettent pas de valeur: pas de destructeur pour eux */
+  if (me % 2 == 0) {
+    unsigned long *value = malloc(sizeof(*value));
+    assert(value != NULL);
+    *value = me;
+    err = thread_setspecific(key, value);
+    assert(!err);
+  }
+
+  for(i=0; i<NB_YIELDS; i++) {
+    thread_yield();
+    if (me % 2 == 0)
+      assert(*(unsigned long *) thread_getspecific(key) == me);
+    else
+      assert(thread_getspecific(key) == NULL);
+  }
+  return NULL;
+}
+
+int main()
+{
+  thread_t th[NB_THREADS];
+  unsigned long i, expected_sum = 0;
+  int err;
+
+  err = thread_mutex_init(&lock);
+  assert(!err);
+  err = thread_key_create(&key, destructor);
+  assert(!err);
+  assert(thread_getspecific(key) == NULL);
+
+  for(i=0; i<NB_THREADS; i++) {
+    err = thread_create(&th[i], thfunc, (void*) i);
+    assert(!err);
+    if (i % 2 == 0)
+      expected_sum += i;
+  }
+  for(i=0; i<NB_THREADS; i++) {
+    err = thread_join(th[i], NULL);
+    assert(!err);
+  }
+
+  if (nb_destructions != NB_THREADS / 2 || sum_destroyed != expected_sum) {
+    printf("%d destructions (somme %lu) au lieu de %d (somme %lu) (FAILED)\n",
+           nb_destructions, sum_destroyed, NB_THREADS / 2, expected_sum);
+    return EXIT_FAILURE;
+  }
+
+  /* une clé détruite puis recréée ne garde pas l'ancienne valeur */
+  err = thread_setspecific(key, &i);
+  assert(!err);
+  err = thread_key_delete(key);
+  assert(!err);
+  err = thread_key_create(&key, NULL);
+  assert(!err);
+  if (thread_getspecific(key) != NULL) {
+    printf("la clé recréée a gardé l'ancienne valeur (FAILED)\n");
+    return EXIT_FAILURE;
+  }
+  err = thread_key_delete(key);
+  assert(!err);
+  thread_mutex_destroy(&lock);
+
+  printf("%d destructeurs appelés, clés OK\n", nb_destructions);
+  return EXIT_SUCCESS;
+}
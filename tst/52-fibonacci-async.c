@@ -0,0 +1,172 @@
+#define _XOPEN_SOURCE 700
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <errno.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include "../src/thread.h"
+
+/* fibonacci avec des futures.
+ *
+ * chaque appel lance fibo(n-1) de manière asynchrone, calcule fibo(n-2) lui-même
+ * puis attend le résultat du premier.
+ * on vérifie aussi thread_future_then (fibo(n) + 1 calculé en suite de fibo(n))
+ * et thread_future_wait_for sur un calcul qui rend la main, puis sur un calcul bloqué:
+ * l'attente doit alors expirer sans consommer le processeur.
+ * la durée doit être proportionnelle à la valeur du résultat.
+ * valgrind doit être content.
+ *
+ * support nécessaire:
+ * - thread_async()
+ * - thread_future_get()
+ * - thread_future_then()
+ * - thread_future_wait_for()
+ * - thread_yield()
+ * - thread_wait_on(), thread_wake()
+ */
+
+#define BLOCKED_WAIT_NS 50000000ULL
+
+static void * fibo(void *_value)
+{
+  thread_future_t future;
+  int err;
+  void *res = NULL, *res2;
+  unsigned long value = (unsigned long) _value;
+
+  if (value < 3)
+    return (void*) 1;
+
+  future = thread_async(fibo, (void*)(value-1));
+  assert(future != NULL);
+  /* on passe un peu la main: certains futures démarrent dans leur propre thread,
+   * les autres sont exécutés directement par thread_future_get */
+  if (value % 4 == 0)
+    thread_yield();
+  res2 = fibo((void*)(value-2));
+  err = thread_future_get(future, &res);
+  assert(!err);
+
+  return (void*)((unsigned long) res + (unsigned long) res2);
+}
+
+static void * increment(void *value)
+{
+  return (void*)((unsigned long) value + 1);
+}
+
+static void * slow(void *arg)
+{
+  int i;
+  for(i=0; i<100; i++)
+    thread_yield();
+  return arg;
+}
+
+unsigned long fibo_checker( unsigned long n )
+{
+  unsigned long a = 1;
+  unsigned long b = 1;
+  unsigned long c, i;
+
+  if ( n <= 2 ) {
+    return 1;
+  }
+
+  for( i=2; i<n; i++ ) {
+    c = a + b;
+    a = b;
+    b = c;
+  }
+  return c;
+}
+
+#ifndef USE_PTHREAD
+static int go = 0;
+
+static void * blocked(void *arg)
+{
+  while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+    thread_wait_on(&go, 0);
+  return arg;
+}
+
+static unsigned long cpu_us(void)
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000UL + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+#endif
+
+int main(int argc, char *argv[])
+{
+  unsigned long value, res;
+  thread_future_t future;
+  void *retval;
+  struct timeval tv1, tv2;
+  double s;
+  int err;
+#ifndef USE_PTHREAD
+  unsigned long cpu;
+#endif
+
+  if (argc < 2) {
+    printf("argument manquant: entier x pour lequel calculer fibonacci(x)\n");
+    return -1;
+  }
+
+  value = atoi(argv[1]);
+  gettimeofday(&tv1, NULL);
+  res = (unsigned long) fibo((void *)value);
+  gettimeofday(&tv2, NULL);
+  s = (tv2.tv_sec-tv1.tv_sec) + (tv2.tv_usec-tv1.tv_usec) * 1e-6;
+
+  if ( res != fibo_checker( value ) ) {
+    printf("fibo de %lu != %lu (FAILED)\n", value, fibo_checker( value ) );
+    return EXIT_FAILURE;
+  }
+
+  /* suite d'un future */
+  future = thread_future_then(thread_async(fibo, (void *)value), increment);
+  assert(future != NULL);
+  err = thread_future_get(future, &retval);
+  assert(!err);
+  if ((unsigned long) retval != res + 1) {
+    printf("suite de fibo de %lu = %lu au lieu de %lu (FAILED)\n", value, (unsigned long) retval, res + 1);
+    return EXIT_FAILURE;
+  }
+
+  /* attente bornée */
+  future = thread_async(slow, (void *)value);
+  assert(future != NULL);
+  err = thread_future_wait_for(future, 0);
+  assert(err == ETIMEDOUT);
+  err = thread_future_wait_for(future, 10ULL * 1000 * 1000 * 1000);
+  assert(!err);
+  err = thread_future_get(future, &retval);
+  assert(!err && (unsigned long) retval == value);
+
+#ifndef USE_PTHREAD
+  /* attente bornée d'un calcul bloqué: plus personne n'est prêt, le processus doit dormir */
+  future = thread_async(blocked, (void *)value);
+  assert(future != NULL);
+  cpu = cpu_us();
+  err = thread_future_wait_for(future, BLOCKED_WAIT_NS);
+  cpu = cpu_us() - cpu;
+  assert(err == ETIMEDOUT);
+  if (cpu > BLOCKED_WAIT_NS / 1000 / 4) {
+    printf("%lu us de processeur pour attendre un calcul bloqué (FAILED)\n", cpu);
+    return EXIT_FAILURE;
+  }
+  __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+  thread_wake(&go, 1);
+  err = thread_future_get(future, &retval);
+  assert(!err && (unsigned long) retval == value);
+#endif
+
+  printf("fibo de %lu = %lu en %e s\n", value, res, s );
+  return EXIT_SUCCESS;
+}
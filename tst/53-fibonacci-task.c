@@ -0,0 +1,173 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <limits.h>
+#include <sys/time.h>
+#include "../src/thread.h"
+
+/* fibonacci avec des tâches fork-join.
+ *
+ * chaque appel lance fibo(n-1) dans une tâche, calcule fibo(n-2) lui-même
+ * puis synchronise la tâche.
+ * on vérifie aussi qu'une tâche qui attend une autre tâche lancée après elle ne bloque pas
+ * tout le monde, et que des tâches prises par les threads ouvriers sont bien attendues.
+ * NB_BLOCKED tâches attendent ensuite une tâche lancée après elles, plus nombreuses que les
+ * ouvriers de départ: elle doit quand même s'exécuter.
+ * la durée doit être proportionnelle à la valeur du résultat.
+ * valgrind doit être content.
+ *
+ * support nécessaire:
+ * - thread_task_spawn()
+ * - thread_task_sync()
+ * - thread_yield()
+ * - thread_wait_on(), thread_wake()
+ */
+
+#define NB_TASKS 50
+#define NB_YIELDS 5
+#define NB_BLOCKED 8
+
+static void * fibo(void *_value)
+{
+  thread_task_t task;
+  int err;
+  void *res = NULL, *res2;
+  unsigned long value = (unsigned long) _value;
+
+  if (value < 3)
+    return (void*) 1;
+
+  err = thread_task_spawn(&task, fibo, (void*)(value-1));
+  assert(!err);
+  res2 = fibo((void*)(value-2));
+  err = thread_task_sync(&task, &res);
+  assert(!err);
+
+  return (void*)((unsigned long) res + (unsigned long) res2);
+}
+
+static volatile int flag = 0;
+
+static void * wait_flag(void *arg)
+{
+  while (!flag)
+    thread_yield();
+  return arg;
+}
+
+static void * set_flag(void *arg)
+{
+  flag = 1;
+  return arg;
+}
+
+static int go = 0;
+
+static void * wait_go(void *arg)
+{
+  while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+    thread_wait_on(&go, 0);
+  return arg;
+}
+
+static void * set_go(void *arg)
+{
+  __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+  thread_wake(&go, INT_MAX);
+  return arg;
+}
+
+static void * square(void *arg)
+{
+  unsigned long value = (unsigned long) arg;
+  int i;
+  for(i=0; i<NB_YIELDS; i++)
+    thread_yield();
+  return (void*)(value * value);
+}
+
+unsigned long fibo_checker( unsigned long n )
+{
+  unsigned long a = 1;
+  unsigned long b = 1;
+  unsigned long c, i;
+
+  if ( n <= 2 ) {
+    return 1;
+  }
+
+  for( i=2; i<n; i++ ) {
+    c = a + b;
+    a = b;
+    b = c;
+  }
+  return c;
+}
+
+int main(int argc, char *argv[])
+{
+  unsigned long value, res, i;
+  thread_task_t tasks[NB_TASKS];
+  void *retval;
+  struct timeval tv1, tv2;
+  double s;
+  int err;
+
+  if (argc < 2) {
+    printf("argument manquant: entier x pour lequel calculer fibonacci(x)\n");
+    return -1;
+  }
+
+  value = atoi(argv[1]);
+  gettimeofday(&tv1, NULL);
+  res = (unsigned long) fibo((void *)value);
+  gettimeofday(&tv2, NULL);
+  s = (tv2.tv_sec-tv1.tv_sec) + (tv2.tv_usec-tv1.tv_usec) * 1e-6;
+
+  if ( res != fibo_checker( value ) ) {
+    printf("fibo de %lu != %lu (FAILED)\n", value, fibo_checker( value ) );
+    return EXIT_FAILURE;
+  }
+
+  /* la première tâche attend la seconde, qui doit s'exécuter ailleurs */
+  err = thread_task_spawn(&tasks[0], wait_flag, (void*) 1);
+  assert(!err);
+  err = thread_task_spawn(&tasks[1], set_flag, (void*) 2);
+  assert(!err);
+  err = thread_task_sync(&tasks[0], &retval);
+  assert(!err && retval == (void*) 1);
+  err = thread_task_sync(&tasks[1], &retval);
+  assert(!err && retval == (void*) 2);
+
+  /* les ouvriers bloqués dans leur tâche ne doivent pas empêcher la dernière de s'exécuter */
+  for(i=0; i<NB_BLOCKED; i++) {
+    err = thread_task_spawn(&tasks[i], wait_go, (void*) i);
+    assert(!err);
+  }
+  err = thread_task_spawn(&tasks[NB_BLOCKED], set_go, (void*) NB_BLOCKED);
+  assert(!err);
+  for(i=0; i<=NB_BLOCKED; i++) {
+    err = thread_task_sync(&tasks[i], &retval);
+    assert(!err && retval == (void*) i);
+  }
+
+  /* des tâches qui passent la main, dont une partie est prise par les ouvriers */
+  for(i=0; i<NB_TASKS; i++) {
+    err = thread_task_spawn(&tasks[i], square, (void*) i);
+    assert(!err);
+  }
+  thread_yield();
+  for(i=0; i<NB_TASKS; i++) {
+    err = thread_task_sync(&tasks[i], &retval);
+    assert(!err);
+    if ((unsigned long) retval != i * i) {
+      printf("tâche %lu: %lu au lieu de %lu (FAILED)\n", i, (unsigned long) retval, i * i);
+      return EXIT_FAILURE;
+    }
+  }
+
+  printf("fibo de %lu = %lu en %e s\n", value, res, s );
+  return EXIT_SUCCESS;
+}
@@ -70,7 +70,8 @@ int main(void)
   assert(!err);
 
   printf("pere: attend que le fils soit pret\n");
-  while (pret != 1)
+  /* le fils peut avoir déjà déverrouillé (pret == 2) s'il a gardé la main */
+  while (pret == 0)
     thread_yield();
 
   printf("pere: fils pret, on verrouille\n");
@@ -0,0 +1,88 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <limits.h>
+#include <errno.h>
+#include <assert.h>
+#include "../src/thread.h"
+
+/* test de l'attente sur une adresse.
+ *
+ * des threads se passent un témoin le long d'une chaîne: le thread i attend que sa
+ * case passe à 1, puis met la case suivante à 1 et réveille un seul thread sur son adresse.
+ * ensuite tous les threads attendent un même drapeau que le main lève en les réveillant tous.
+ * le programme doit finir, avec tous les threads passés dans l'ordre de la chaîne.
+ * valgrind doit être content.
+ *
+ * support nécessaire:
+ * - thread_create()
+ * - thread_join()
+ * - thread_wait_on()
+ * - thread_wake()
+ */
+
+#define NB_THREADS 20
+
+static int cells[NB_THREADS + 1];
+static int go = 0;
+static int order[NB_THREADS];
+static int nb_passed = 0;
+
+static void * thfunc(void *arg)
+{
+  unsigned long me = (unsigned long) arg;
+
+  /* attente du témoin */
+  while (cells[me] == 0)
+    thread_wait_on(&cells[me], 0);
+  order[nb_passed++] = me;
+  cells[me + 1] = 1;
+  thread_wake(&cells[me + 1], 1);
+
+  /* attente du drapeau commun */
+  while (go == 0)
+    thread_wait_on(&go, 0);
+  return NULL;
+}
+
+int main()
+{
+  thread_t th[NB_THREADS];
+  unsigned long i;
+  int err;
+
+  /* la valeur ne correspond pas: pas d'attente */
+  cells[0] = 1;
+  err = thread_wait_on(&cells[0], 0);
+  assert(err == EAGAIN);
+  cells[0] = 0;
+
+  /* les threads sont créés dans l'ordre inverse de la chaîne */
+  for(i=0; i<NB_THREADS; i++) {
+    err = thread_create(&th[i], thfunc, (void*) (NB_THREADS - 1 - i));
+    assert(!err);
+  }
+
+  cells[0] = 1;
+  thread_wake(&cells[0], 1);
+  while (cells[NB_THREADS] == 0)
+    thread_wait_on(&cells[NB_THREADS], 0);
+
+  go = 1;
+  thread_wake(&go, INT_MAX);
+
+  for(i=0; i<NB_THREADS; i++) {
+    err = thread_join(th[i], NULL);
+    assert(!err);
+  }
+
+  for(i=0; i<NB_THREADS; i++) {
+    if (order[i] != (int) i) {
+      printf("le thread %d est passé en position %lu (FAILED)\n", order[i], i);
+      return EXIT_FAILURE;
+    }
+  }
+  printf("%d threads réveillés dans l'ordre\n", nb_passed);
+  return EXIT_SUCCESS;
+}
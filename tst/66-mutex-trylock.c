@@ -0,0 +1,158 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+#include <assert.h>
+#include <sys/time.h>
+#include "../src/thread.h"
+
+/* test de thread_mutex_trylock et thread_mutex_timedlock.
+ *
+ * le main garde le mutex pendant que:
+ * - un fils essaie de le prendre sans attendre (EBUSY);
+ * - un fils l'attend sans échéance et un autre avec une échéance courte, qui doit
+ *   expirer (ETIMEDOUT, au bout d'au moins TIMEOUT_US) sans faire perdre son réveil au premier;
+ * - un fils l'attend avec une échéance longue, et doit l'obtenir quand le main le rend.
+ * enfin le main attend un mutex gardé par un fils bloqué: plus personne n'est prêt,
+ * l'échéance doit quand même expirer.
+ * valgrind doit être content.
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_yield()
+ * - thread_mutex_lock(), thread_mutex_unlock()
+ * - thread_mutex_trylock(), thread_mutex_timedlock()
+ * - thread_wait_on(), thread_wake()
+ */
+
+#define TIMEOUT_US 2000
+#define LONG_TIMEOUT_NS 10000000000ULL
+
+static thread_mutex_t lock;
+static volatile int nb_done = 0;
+static int go = 0;
+
+static unsigned long elapsed_us(struct timeval *tv1)
+{
+  struct timeval tv2;
+  gettimeofday(&tv2, NULL);
+  return (tv2.tv_sec-tv1->tv_sec)*1000000+(tv2.tv_usec-tv1->tv_usec);
+}
+
+static void * try(void *arg __attribute__((unused)))
+{
+  int err = thread_mutex_trylock(&lock);
+  __atomic_add_fetch(&nb_done, 1, __ATOMIC_RELEASE);
+  return (void*)(long) err;
+}
+
+static void * wait_forever(void *arg)
+{
+  int err = thread_mutex_lock(&lock);
+  assert(!err);
+  thread_mutex_unlock(&lock);
+  return arg;
+}
+
+static void * wait_short(void *arg)
+{
+  struct timeval tv1;
+  unsigned long us;
+  int err;
+
+  gettimeofday(&tv1, NULL);
+  err = thread_mutex_timedlock(&lock, TIMEOUT_US * 1000ULL);
+  us = elapsed_us(&tv1);
+  __atomic_add_fetch(&nb_done, 1, __ATOMIC_RELEASE);
+  if (err != ETIMEDOUT || us < TIMEOUT_US) {
+    printf("timedlock a renvoyé %d au bout de %lu us (FAILED)\n", err, us);
+    exit(EXIT_FAILURE);
+  }
+  return arg;
+}
+
+static void * wait_long(void *arg)
+{
+  int err = thread_mutex_timedlock(&lock, LONG_TIMEOUT_NS);
+  assert(!err);
+  thread_mutex_unlock(&lock);
+  return arg;
+}
+
+static void * hold_blocked(void *arg)
+{
+  int err = thread_mutex_lock(&lock);
+  assert(!err);
+  __atomic_add_fetch(&nb_done, 1, __ATOMIC_RELEASE);
+  while (!__atomic_load_n(&go, __ATOMIC_ACQUIRE))
+    thread_wait_on(&go, 0);
+  thread_mutex_unlock(&lock);
+  return arg;
+}
+
+int main()
+{
+  thread_t th[3];
+  struct timeval tv1;
+  unsigned long us;
+  void *res;
+  int err;
+
+  err = thread_mutex_init(&lock);
+  assert(!err);
+
+  /* trylock d'un mutex libre, puis détenu */
+  err = thread_mutex_trylock(&lock);
+  assert(!err);
+  err = thread_create(&th[0], try, NULL);
+  assert(!err);
+  err = thread_join(th[0], &res);
+  assert(!err);
+  if (res != (void*)(long) EBUSY) {
+    printf("trylock d'un mutex détenu a renvoyé %ld au lieu de EBUSY (FAILED)\n", (long) res);
+    return EXIT_FAILURE;
+  }
+
+  /* une attente sans échéance et une attente qui expire pendant que le main garde le mutex */
+  nb_done = 0;
+  err = thread_create(&th[0], wait_forever, (void*) 1);
+  assert(!err);
+  err = thread_create(&th[1], wait_short, (void*) 2);
+  assert(!err);
+  err = thread_create(&th[2], wait_long, (void*) 3);
+  assert(!err);
+  while (__atomic_load_n(&nb_done, __ATOMIC_ACQUIRE) < 1)
+    thread_yield();
+  err = thread_join(th[1], &res);
+  assert(!err && res == (void*) 2);
+
+  /* les deux autres doivent obtenir le mutex quand il est rendu */
+  err = thread_mutex_unlock(&lock);
+  assert(!err);
+  err = thread_join(th[0], &res);
+  assert(!err && res == (void*) 1);
+  err = thread_join(th[2], &res);
+  assert(!err && res == (void*) 3);
+
+  /* échéance alors que plus aucun thread n'est prêt */
+  nb_done = 0;
+  err = thread_create(&th[0], hold_blocked, NULL);
+  assert(!err);
+  while (__atomic_load_n(&nb_done, __ATOMIC_ACQUIRE) < 1)
+    thread_yield();
+  gettimeofday(&tv1, NULL);
+  err = thread_mutex_timedlock(&lock, TIMEOUT_US * 1000ULL);
+  us = elapsed_us(&tv1);
+  if (err != ETIMEDOUT || us < TIMEOUT_US) {
+    printf("timedlock du main a renvoyé %d au bout de %lu us (FAILED)\n", err, us);
+    return EXIT_FAILURE;
+  }
+  __atomic_store_n(&go, 1, __ATOMIC_RELEASE);
+  thread_wake(&go, 1);
+  err = thread_join(th[0], NULL);
+  assert(!err);
+
+  thread_mutex_destroy(&lock);
+  printf("trylock et timedlock ont le comportement attendu\n");
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,149 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <errno.h>
+#include "../src/thread.h"
+
+/* test du profil de contention des mutex.
+ *
+ * un mutex initialisé avant thread_mutex_profile_start n'est pas profilé. ensuite, un mutex
+ * pris NB_LOCKS fois sans concurrence ne doit compter aucune attente, et un mutex qu'un fils
+ * attend pendant que le main le garde doit compter exactement une attente, avec un temps non nul.
+ * chaque détention doit apparaître dans l'histogramme, et le mutex contendu doit être le premier
+ * du fichier écrit par thread_mutex_profile_dump.
+ * enfin un thread_mutex_timedlock qui expire doit compter un timeout, ni attente ni prise.
+ * valgrind doit être content.
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_yield()
+ * - thread_mutex_lock(), thread_mutex_unlock(), thread_mutex_timedlock()
+ * - thread_mutex_profile_start(), thread_mutex_setname()
+ * - thread_mutex_getprofile(), thread_mutex_profile_dump()
+ */
+
+#define NB_LOCKS 10
+#define DUMP_PATH "67-mutex-profile.txt"
+#define TIMEOUT_NS 1000000ULL
+
+static thread_mutex_t quiet, contended, timed;
+static volatile int waiting = 0;
+
+static void * waiter(void *arg)
+{
+  waiting = 1;
+  thread_mutex_lock(&contended);
+  thread_mutex_unlock(&contended);
+  return arg;
+}
+
+static void * timed_waiter(void *arg)
+{
+  return thread_mutex_timedlock(&timed, TIMEOUT_NS) == ETIMEDOUT ? arg : NULL;
+}
+
+static unsigned long long nb_holds(struct thread_mutex_profile *profile)
+{
+  unsigned long long n = 0;
+  int i;
+  for(i=0; i<THREAD_MUTEX_PROFILE_BUCKETS; i++)
+    n += profile->hold_histogram[i];
+  return n;
+}
+
+int main()
+{
+  struct thread_mutex_profile profile;
+  thread_mutex_t before;
+  thread_t th;
+  void *res;
+  char line[256];
+  FILE *file;
+  int i, err;
+
+  thread_mutex_init(&before);
+  if (thread_mutex_profile_start() != 0) {
+    printf("pas de profil des mutex avec cette bibliothèque\n");
+    return EXIT_SUCCESS;
+  }
+  assert(thread_mutex_getprofile(&before, &profile) == -1);
+  thread_mutex_init(&quiet);
+  thread_mutex_init(&contended);
+  err = thread_mutex_setname(&contended, "contended");
+  assert(!err);
+
+  for(i=0; i<NB_LOCKS; i++) {
+    thread_mutex_lock(&quiet);
+    thread_mutex_unlock(&quiet);
+  }
+
+  thread_mutex_lock(&contended);
+  err = thread_create(&th, waiter, NULL);
+  assert(!err);
+  while (!waiting)
+    thread_yield();
+  for(i=0; i<NB_LOCKS; i++)
+    thread_yield();
+  thread_mutex_unlock(&contended);
+  err = thread_join(th, NULL);
+  assert(!err);
+
+  err = thread_mutex_getprofile(&quiet, &profile);
+  assert(!err);
+  if (profile.nb_acquisitions != NB_LOCKS || profile.nb_contended != 0 || profile.wait_cycles != 0 ||
+      nb_holds(&profile) != NB_LOCKS || profile.name != NULL) {
+    printf("mutex sans concurrence: %llu prises, %llu attentes (FAILED)\n", profile.nb_acquisitions, profile.nb_contended);
+    return EXIT_FAILURE;
+  }
+
+  err = thread_mutex_getprofile(&contended, &profile);
+  assert(!err);
+  if (profile.nb_acquisitions != 2 || profile.nb_contended != 1 || profile.wait_cycles == 0 ||
+      profile.max_wait_cycles != profile.wait_cycles || nb_holds(&profile) != 2 ||
+      strcmp(profile.name, "contended") != 0) {
+    printf("mutex contendu: %llu prises, %llu attentes, %llu cycles d'attente (FAILED)\n",
+           profile.nb_acquisitions, profile.nb_contended, profile.wait_cycles);
+    return EXIT_FAILURE;
+  }
+
+  err = thread_mutex_profile_dump(DUMP_PATH, 1);
+  assert(!err);
+  file = fopen(DUMP_PATH, "r");
+  assert(file != NULL);
+  if (fgets(line, sizeof(line), file) == NULL || fgets(line, sizeof(line), file) == NULL ||
+      strncmp(line, "#1 contended ", 13) != 0) {
+    printf("le mutex contendu n'est pas le premier du profil (FAILED)\n");
+    return EXIT_FAILURE;
+  }
+  fclose(file);
+  remove(DUMP_PATH);
+
+  /* le main garde le mutex pendant que le fils abandonne son attente */
+  thread_mutex_init(&timed);
+  thread_mutex_lock(&timed);
+  err = thread_create(&th, timed_waiter, (void*) 1);
+  assert(!err);
+  err = thread_join(th, &res);
+  assert(!err && res == (void*) 1);
+  thread_mutex_unlock(&timed);
+  err = thread_mutex_getprofile(&timed, &profile);
+  assert(!err);
+  if (profile.nb_acquisitions != 1 || profile.nb_contended != 0 || profile.wait_cycles != 0 ||
+      profile.nb_timeouts != 1 || profile.timeout_cycles == 0) {
+    printf("timedlock expiré: %llu prises, %llu attentes, %llu timeouts (FAILED)\n",
+           profile.nb_acquisitions, profile.nb_contended, profile.nb_timeouts);
+    return EXIT_FAILURE;
+  }
+  err = thread_mutex_getprofile(&contended, &profile);
+  assert(!err);
+
+  thread_mutex_destroy(&timed);
+  thread_mutex_destroy(&before);
+  thread_mutex_destroy(&quiet);
+  thread_mutex_destroy(&contended);
+  printf("profil: %llu prises, %llu attente de %llu cycles pour le mutex contendu\n",
+         profile.nb_acquisitions, profile.nb_contended, profile.wait_cycles);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,196 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <assert.h>
+#include <poll.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include "../src/thread.h"
+
+/* test de l'attente d'un descripteur de fichier.
+ *
+ * un fils attend de pouvoir lire un tube pendant que le main continue de s'exécuter, puis
+ * lit ce que le main y écrit. ensuite le main attend un tube qu'un fils remplit au bout
+ * de SLEEP_NS: pendant ce temps plus aucun thread n'est prêt, et le processus doit dormir
+ * plutôt que consommer le processeur.
+ * un fils attend aussi un tube que le main ferme pendant l'attente: il doit être réveillé avec
+ * -1 et EBADF au lieu de rester bloqué pour toujours.
+ * enfin un processus fils se bloque pour toujours (le main garde un mutex et joint un thread
+ * qui l'attend): la bibliothèque doit le signaler sur la sortie d'erreur et l'arrêter par abort().
+ * valgrind doit être content.
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_yield()
+ * - thread_wait_fd(), thread_timedwait_on()
+ * - thread_mutex_lock(), thread_mutex_unlock()
+ */
+
+#define SLEEP_NS 20000000ULL
+#define MAX_CPU_US 10000
+
+static int fds[2];
+static volatile int reading = 0;
+
+static void * reader(void *arg)
+{
+  char c;
+  int events;
+
+  reading = 1;
+  events = thread_wait_fd(fds[0], POLLIN);
+  if (!(events & POLLIN) || read(fds[0], &c, 1) != 1)
+    return NULL;
+  return c == 'x' ? arg : NULL;
+}
+
+static void * late_writer(void *arg)
+{
+  int never = 0;
+  thread_timedwait_on(&never, 0, SLEEP_NS);
+  if (write(fds[1], "y", 1) != 1)
+    return NULL;
+  return arg;
+}
+
+static unsigned long cpu_us(void)
+{
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (usage.ru_utime.tv_sec + usage.ru_stime.tv_sec) * 1000000UL + usage.ru_utime.tv_usec + usage.ru_stime.tv_usec;
+}
+
+#ifndef USE_PTHREAD
+static thread_mutex_t lock;
+static int closed_fds[2];
+
+static void * closed_reader(void *arg)
+{
+  reading = 1;
+  if (thread_wait_fd(closed_fds[0], POLLIN) != -1 || errno != EBADF)
+    return NULL;
+  return arg;
+}
+
+static void * locker(void *arg)
+{
+  thread_mutex_lock(&lock);
+  thread_mutex_unlock(&lock);
+  return arg;
+}
+
+/* dans un processus fils: doit se terminer par abort() après avoir décrit le deadlock */
+static int check_deadlock_report(void)
+{
+  char report[1024];
+  int errfds[2], status;
+  ssize_t n, len = 0;
+  pid_t pid;
+
+  if (pipe(errfds) == -1)
+    return -1;
+  pid = fork();
+  if (pid == 0) {
+    thread_t th;
+    dup2(errfds[1], STDERR_FILENO);
+    close(errfds[0]);
+    thread_mutex_init(&lock);
+    thread_mutex_lock(&lock);
+    thread_create(&th, locker, NULL);
+    thread_join(th, NULL);
+    _exit(EXIT_SUCCESS);
+  }
+  close(errfds[1]);
+  while (len < (ssize_t) sizeof(report) - 1 && (n = read(errfds[0], report + len, sizeof(report) - 1 - len)) > 0)
+    len += n;
+  report[len] = '\0';
+  close(errfds[0]);
+  waitpid(pid, &status, 0);
+  if (!WIFSIGNALED(status) || WTERMSIG(status) != SIGABRT || strstr(report, "deadlock") == NULL) {
+    printf("le processus bloqué n'a pas été arrêté par abort() avec un rapport: %s (FAILED)\n", report);
+    return -1;
+  }
+  return 0;
+}
+#endif
+
+int main()
+{
+  struct timeval tv1, tv2;
+  unsigned long cpu, us;
+  thread_t th;
+  void *res;
+  char c;
+  int err, events;
+
+  err = pipe(fds);
+  assert(!err);
+
+  /* un fils bloqué sur le tube n'empêche pas le main de s'exécuter */
+  err = thread_create(&th, reader, (void*) 1);
+  assert(!err);
+  while (!reading)
+    thread_yield();
+  thread_yield();
+  if (write(fds[1], "x", 1) != 1)
+    return EXIT_FAILURE;
+  err = thread_join(th, &res);
+  assert(!err);
+  if (res != (void*) 1) {
+    printf("le fils n'a pas lu ce que le main a écrit (FAILED)\n");
+    return EXIT_FAILURE;
+  }
+
+  /* plus personne de prêt: le processus doit dormir jusqu'à l'écriture */
+  err = thread_create(&th, late_writer, (void*) 2);
+  assert(!err);
+  cpu = cpu_us();
+  gettimeofday(&tv1, NULL);
+  events = thread_wait_fd(fds[0], POLLIN);
+  gettimeofday(&tv2, NULL);
+  cpu = cpu_us() - cpu;
+  us = (tv2.tv_sec - tv1.tv_sec) * 1000000UL + tv2.tv_usec - tv1.tv_usec;
+  if (!(events & POLLIN) || read(fds[0], &c, 1) != 1 || c != 'y') {
+    printf("thread_wait_fd a renvoyé %d (FAILED)\n", events);
+    return EXIT_FAILURE;
+  }
+  err = thread_join(th, &res);
+  assert(!err && res == (void*) 2);
+  if (cpu > MAX_CPU_US) {
+    printf("%lu us de processeur pour %lu us d'attente (FAILED)\n", cpu, us);
+    return EXIT_FAILURE;
+  }
+  close(fds[0]);
+  close(fds[1]);
+
+#ifndef USE_PTHREAD
+  /* le descripteur attendu est fermé: le fils ne doit pas attendre pour toujours */
+  err = pipe(closed_fds);
+  assert(!err);
+  reading = 0;
+  err = thread_create(&th, closed_reader, (void*) 3);
+  assert(!err);
+  while (!reading)
+    thread_yield();
+  thread_yield();
+  close(closed_fds[0]);
+  err = thread_join(th, &res);
+  assert(!err);
+  close(closed_fds[1]);
+  if (res != (void*) 3) {
+    printf("thread_wait_fd sur un descripteur fermé n'a pas renvoyé EBADF (FAILED)\n");
+    return EXIT_FAILURE;
+  }
+
+  if (check_deadlock_report() != 0)
+    return EXIT_FAILURE;
+#endif
+
+  printf("attente de %lu us avec %lu us de processeur\n", us, cpu);
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,102 @@
+#define _DEFAULT_SOURCE
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "../src/thread.h"
+
+/* test des réveils venant d'autres threads noyau.
+ *
+ * NB_WORKERS threads de la bibliothèque attendent dans thread_park que des pthreads
+ * (NB_FOREIGN, hors de la bibliothèque) leur aient posté NB_POSTS valeurs chacun: chaque
+ * pthread incrémente le compteur d'un thread puis le réveille avec thread_wake_external,
+ * et s'endort de temps en temps pour que plus aucun thread de la bibliothèque ne soit prêt.
+ * aucun réveil ne doit être perdu, sinon le programme reste bloqué.
+ * un réveil arrivé avant thread_park doit le faire revenir aussitôt.
+ *
+ * support nécessaire:
+ * - thread_create(), thread_join(), thread_self()
+ * - thread_park(), thread_wake_external()
+ */
+
+#define NB_WORKERS 4
+#define NB_FOREIGN 2
+#define NB_POSTS 2000
+#define SLEEP_EVERY 250
+
+static thread_t workers[NB_WORKERS];
+static int posted[NB_WORKERS];
+static volatile int started = 0;
+
+static void * worker(void *arg)
+{
+  int me = (int)(long) arg;
+  int nb_parks = 0;
+
+  while (__atomic_load_n(&posted[me], __ATOMIC_ACQUIRE) < NB_FOREIGN * NB_POSTS) {
+    int err = thread_park();
+    assert(!err);
+    nb_parks++;
+  }
+  return (void*)(long) nb_parks;
+}
+
+static void * foreign(void *arg)
+{
+  int i, w;
+  (void) arg;
+
+  while (!started)
+    usleep(100);
+  for(i=0; i<NB_POSTS; i++) {
+    for(w=0; w<NB_WORKERS; w++) {
+      __atomic_add_fetch(&posted[w], 1, __ATOMIC_RELEASE);
+      if (thread_wake_external(workers[w]) != 0) {
+        perror("thread_wake_external");
+        exit(EXIT_FAILURE);
+      }
+    }
+    if (i % SLEEP_EVERY == 0)
+      usleep(1000);
+  }
+  return NULL;
+}
+
+int main()
+{
+  pthread_t foreigners[NB_FOREIGN];
+  long nb_parks = 0;
+  void *res;
+  int i, err;
+
+  /* un réveil arrivé avant thread_park n'est pas perdu */
+  err = thread_wake_external(thread_self());
+  assert(!err);
+  err = thread_park();
+  assert(!err);
+
+  for(i=0; i<NB_WORKERS; i++) {
+    err = thread_create(&workers[i], worker, (void*)(long) i);
+    assert(!err);
+  }
+  for(i=0; i<NB_FOREIGN; i++) {
+    err = pthread_create(&foreigners[i], NULL, foreign, NULL);
+    assert(!err);
+  }
+  started = 1;
+
+  for(i=0; i<NB_WORKERS; i++) {
+    err = thread_join(workers[i], &res);
+    assert(!err);
+    nb_parks += (long) res;
+  }
+  for(i=0; i<NB_FOREIGN; i++) {
+    err = pthread_join(foreigners[i], NULL);
+    assert(!err);
+  }
+
+  printf("%d réveils externes reçus en %ld attentes\n", NB_WORKERS * NB_FOREIGN * NB_POSTS, nb_parks);
+  return EXIT_SUCCESS;
+}
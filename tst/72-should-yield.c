@@ -0,0 +1,61 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <assert.h>
+#include <stdint.h>
+#include "../src/thread.h"
+
+/* test du passage de main coopératif sur fin de tranche.
+ *
+ * des threads calculent en boucle jusqu'à ce que tous aient démarré, sans jamais appeler
+ * thread_yield directement: seul THREAD_MAYBE_YIELD() leur fait passer la main, quand
+ * leur tranche de temps est épuisée. sans cela, le premier thread tournerait indéfiniment.
+ * le programme doit finir.
+ * valgrind doit être content.
+ *
+ * support nécessaire:
+ * - thread_create()
+ * - thread_join() avec récupération de la valeur de retour
+ * - THREAD_MAYBE_YIELD()
+ */
+
+#define NB_THREADS 4
+
+static volatile int started[NB_THREADS];
+
+static void * thfunc(void *arg)
+{
+  int me = (intptr_t) arg;
+  unsigned long loops = 0;
+  int i, all;
+
+  started[me] = 1;
+  do {
+    loops++;
+    THREAD_MAYBE_YIELD();
+    all = 1;
+    for(i=0; i<NB_THREADS; i++)
+      all &= started[i];
+  } while (!all);
+  return (void*) loops;
+}
+
+int main()
+{
+  thread_t th[NB_THREADS];
+  unsigned long loops = 0;
+  void *res;
+  int i, err;
+
+  for(i=0; i<NB_THREADS; i++) {
+    err = thread_create(&th[i], thfunc, (void*)(intptr_t) i);
+    assert(!err);
+  }
+  for(i=0; i<NB_THREADS; i++) {
+    err = thread_join(th[i], &res);
+    assert(!err);
+    loops += (unsigned long) res;
+  }
+
+  printf("%d threads ont tous démarré après %lu tours de boucle\n", NB_THREADS, loops);
+  return EXIT_SUCCESS;
+}
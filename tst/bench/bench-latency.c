@@ -0,0 +1,161 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdint.h>
+#include "bench.h"
+
+/* latences des chemins critiques de l'ordonnanceur:
+ * - pingpong_yield: entre le moment où un thread passe la main avec thread_yield et celui où l'autre reprend
+ * - pingpong_yield_to: la même chose avec thread_yield_to, qui désigne l'autre thread
+ * - mutex_handoff: entre thread_mutex_unlock et le moment où le thread qui attendait le mutex s'exécute
+ * - join_wakeup: entre la fin d'un thread et le moment où le thread qui le joint reprend
+ *
+ * la sortie est un JSON lisible par plot_graph.py --json ou --hist
+ */
+
+#define NB_YIELD_TO_BLOCK 10
+
+static struct bench_series *series;
+static volatile unsigned long long sent;
+static volatile int turn, state;
+static thread_mutex_t lock;
+static thread_t players[2];
+static int directed;
+
+static void * player(void *arg)
+{
+  int me = (intptr_t) arg;
+  int i;
+
+  for (i = 0; i < bench_warmup + bench_reps / 2; i++) {
+    while (turn != me) {
+      if (directed)
+        thread_yield_to(players[1 - me]);
+      else
+        thread_yield();
+    }
+    unsigned long long now = bench_ticks();
+    if (i >= bench_warmup)
+      bench_series_add(series, now - sent);
+    sent = bench_ticks();
+    turn = 1 - me;
+  }
+  return NULL;
+}
+
+static void bench_pingpong(const char *name, int use_yield_to)
+{
+  int i, err;
+
+  series = bench_series_new(name, 1);
+  turn = 0;
+  directed = use_yield_to;
+  for (i = 0; i < 2; i++) {
+    err = thread_create(&players[i], player, (void *)(intptr_t) i);
+    assert(!err);
+  }
+  for (i = 0; i < 2; i++)
+    thread_join(players[i], NULL);
+}
+
+static void * holder(void *arg)
+{
+  int i, k;
+  (void) arg;
+
+  for (i = 0; i < bench_warmup + bench_reps; i++) {
+    thread_mutex_lock(&lock);
+    state = 1;
+    while (state != 2)
+      thread_yield();
+    /* on laisse le temps à l'autre thread de se bloquer sur le mutex */
+    for (k = 0; k < NB_YIELD_TO_BLOCK; k++)
+      thread_yield();
+    sent = bench_ticks();
+    thread_mutex_unlock(&lock);
+    while (state != 3)
+      thread_yield();
+  }
+  return NULL;
+}
+
+static void * waiter(void *arg)
+{
+  int i;
+  (void) arg;
+
+  for (i = 0; i < bench_warmup + bench_reps; i++) {
+    while (state != 1)
+      thread_yield();
+    state = 2;
+    thread_mutex_lock(&lock);
+    unsigned long long now = bench_ticks();
+    if (i >= bench_warmup)
+      bench_series_add(series, now - sent);
+    state = 3;
+    thread_mutex_unlock(&lock);
+  }
+  return NULL;
+}
+
+static void bench_mutex_handoff(void)
+{
+  thread_t th[2];
+  int err;
+
+  series = bench_series_new("mutex_handoff", 1);
+  state = 0;
+  thread_mutex_init(&lock);
+  err = thread_create(&th[0], holder, NULL);
+  assert(!err);
+  err = thread_create(&th[1], waiter, NULL);
+  assert(!err);
+  thread_join(th[0], NULL);
+  thread_join(th[1], NULL);
+  thread_mutex_destroy(&lock);
+}
+
+static void * joined(void *arg)
+{
+  int k;
+  state = 1;
+  while (state != 2)
+    thread_yield();
+  /* on laisse le temps au main de se bloquer dans le join */
+  for (k = 0; k < NB_YIELD_TO_BLOCK; k++)
+    thread_yield();
+  sent = bench_ticks();
+  return arg;
+}
+
+static void bench_join_wakeup(void)
+{
+  thread_t th;
+  int i, err;
+
+  series = bench_series_new("join_wakeup", 1);
+  for (i = 0; i < bench_warmup + bench_reps; i++) {
+    state = 0;
+    err = thread_create(&th, joined, NULL);
+    assert(!err);
+    while (state != 1)
+      thread_yield();
+    state = 2;
+    err = thread_join(th, NULL);
+    unsigned long long now = bench_ticks();
+    assert(!err);
+    if (i >= bench_warmup)
+      bench_series_add(series, now - sent);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  bench_init(argc, argv);
+
+  bench_pingpong("pingpong_yield", 0);
+  bench_pingpong("pingpong_yield_to", 1);
+  bench_mutex_handoff();
+  bench_join_wakeup();
+
+  return bench_finish();
+}
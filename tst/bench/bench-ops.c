@@ -0,0 +1,117 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include "bench.h"
+
+/* coût des opérations de base, une à une: création, join, création + join, yield,
+ * THREAD_MAYBE_YIELD (hors fin de tranche, la lecture d'un drapeau), mutex.
+ *
+ * la sortie est un JSON lisible par plot_graph.py --json
+ */
+
+#define NB_PENDING 100
+
+static volatile int done = 0;
+static thread_mutex_t lock;
+
+static void * empty(void *arg)
+{
+  return arg;
+}
+
+static void * mark_done(void *arg)
+{
+  done = 1;
+  return arg;
+}
+
+static void op_create_join(void *arg)
+{
+  thread_t th;
+  int err;
+  (void) arg;
+  err = thread_create(&th, empty, NULL);
+  assert(!err);
+  err = thread_join(th, NULL);
+  assert(!err);
+}
+
+static void op_yield(void *arg)
+{
+  (void) arg;
+  thread_yield();
+}
+
+static void op_maybe_yield(void *arg)
+{
+  (void) arg;
+  THREAD_MAYBE_YIELD();
+}
+
+static void op_mutex(void *arg)
+{
+  (void) arg;
+  thread_mutex_lock(&lock);
+  thread_mutex_unlock(&lock);
+}
+
+/* création seule: les threads sont joints par paquets, hors mesure */
+static void bench_create(void)
+{
+  struct bench_series *series = bench_series_new("create", 1);
+  thread_t th[NB_PENDING];
+  int i, j, n = 0, err;
+
+  for (i = 0; i < bench_warmup + bench_reps; i++) {
+    unsigned long long start = bench_ticks();
+    err = thread_create(&th[n++], empty, NULL);
+    unsigned long long end = bench_ticks();
+    assert(!err);
+    if (i >= bench_warmup)
+      bench_series_add(series, end - start);
+    if (n == NB_PENDING) {
+      for (j = 0; j < n; j++)
+        thread_join(th[j], NULL);
+      n = 0;
+    }
+  }
+  for (j = 0; j < n; j++)
+    thread_join(th[j], NULL);
+}
+
+/* join seul, d'un thread déjà terminé */
+static void bench_join(void)
+{
+  struct bench_series *series = bench_series_new("join", 1);
+  thread_t th;
+  int i, err;
+
+  for (i = 0; i < bench_warmup + bench_reps; i++) {
+    done = 0;
+    err = thread_create(&th, mark_done, NULL);
+    assert(!err);
+    while (!done)
+      thread_yield();
+    unsigned long long start = bench_ticks();
+    err = thread_join(th, NULL);
+    unsigned long long end = bench_ticks();
+    assert(!err);
+    if (i >= bench_warmup)
+      bench_series_add(series, end - start);
+  }
+}
+
+int main(int argc, char *argv[])
+{
+  bench_init(argc, argv);
+  thread_mutex_init(&lock);
+
+  bench_create();
+  bench_join();
+  bench_run("create_join", op_create_join, NULL, 1);
+  bench_run("yield", op_yield, NULL, 100);
+  bench_run("maybe_yield", op_maybe_yield, NULL, 100);
+  bench_run("mutex_lock_unlock", op_mutex, NULL, 100);
+
+  thread_mutex_destroy(&lock);
+  return bench_finish();
+}
@@ -0,0 +1,125 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <stdint.h>
+#include "bench.h"
+
+/* temps de réponse de la préemption.
+ *
+ * des threads calculent sans jamais rendre la main en notant l'instant de leur dernière
+ * instruction. le premier thread qui reprend après une préemption mesure l'écart avec
+ * la dernière instruction du thread préempté: réception du SIGALRM, ordonnanceur et
+ * changement de contexte.
+ *
+ * mutex_contended_lock: durée de thread_mutex_lock quand NB_LOCKERS threads prennent en boucle
+ * un mutex pour une courte section critique. le détenteur est parfois préempté dans sa section,
+ * et les autres doivent l'attendre. le débit total est noté dans mutex_contended_locks_per_s.
+ *
+ * à lier avec libthreadpr. dure au plus DURATION_NS, le nombre de mesures dépend donc
+ * de la période de préemption.
+ */
+
+#define NB_THREADS 2
+#define DURATION_NS 2000000000ULL
+#define NB_LOCKERS 4
+#define CRITICAL_NS 1000
+#define OUTSIDE_NS 1000
+
+static struct bench_series *series;
+static volatile unsigned long long last_tick[NB_THREADS], deadline;
+static volatile int last_owner = -1, stop = 0;
+static thread_mutex_t lock;
+static unsigned long nb_locks;
+
+static void * spin(void *arg)
+{
+  int me = (intptr_t) arg;
+  int nb_switches = 0;
+
+  while (!stop) {
+    unsigned long long now = bench_ticks();
+    int owner = last_owner;
+    if (owner != me) {
+      /* ce thread a été préempté juste après avoir lu le TSC: on le relit */
+      if (owner != -1 && now < last_tick[owner])
+        continue;
+      if (owner != -1 && nb_switches++ >= bench_warmup)
+        bench_series_add(series, now - last_tick[owner]);
+      last_owner = me;
+    }
+    /* chaque thread a sa propre case: une valeur périmée écrite après une préemption
+     * ne peut pas fausser la mesure de l'autre thread */
+    last_tick[me] = now;
+    if (now > deadline || series->nb_samples == series->capacity)
+      stop = 1;
+  }
+  return NULL;
+}
+
+/* calcule pendant ns nanosecondes, en restant préemptible */
+static void burn(unsigned long long ns)
+{
+  unsigned long long end = bench_ticks() + ns / bench_ns_per_tick;
+  while (bench_ticks() < end)
+    ;
+}
+
+static void * locker(void *arg)
+{
+  (void) arg;
+  while (!stop) {
+    unsigned long long start = bench_ticks();
+    thread_mutex_lock(&lock);
+    unsigned long long acquired = bench_ticks();
+    if (nb_locks++ >= (unsigned long) bench_warmup)
+      bench_series_add(series, acquired - start);
+    burn(CRITICAL_NS);
+    if (acquired > deadline || series->nb_samples == series->capacity)
+      stop = 1;
+    thread_mutex_unlock(&lock);
+    burn(OUTSIDE_NS);
+  }
+  return NULL;
+}
+
+static void bench_mutex_contended(void)
+{
+  thread_t th[NB_LOCKERS];
+  unsigned long long start;
+  int i, err;
+
+  series = bench_series_new("mutex_contended_lock", 1);
+  thread_mutex_init(&lock);
+  stop = 0;
+  nb_locks = 0;
+  start = bench_ticks();
+  deadline = start + DURATION_NS / bench_ns_per_tick;
+  for (i = 0; i < NB_LOCKERS; i++) {
+    err = thread_create(&th[i], locker, NULL);
+    assert(!err);
+  }
+  for (i = 0; i < NB_LOCKERS; i++)
+    thread_join(th[i], NULL);
+  bench_metric("mutex_contended_locks_per_s", nb_locks / bench_to_ns(bench_ticks() - start) * 1e9);
+  thread_mutex_destroy(&lock);
+}
+
+int main(int argc, char *argv[])
+{
+  thread_t th[NB_THREADS];
+  int i, err;
+
+  bench_warmup = 10;
+  bench_init(argc, argv);
+
+  series = bench_series_new("preemption_response", 1);
+  deadline = bench_ticks() + DURATION_NS / bench_ns_per_tick;
+  for (i = 0; i < NB_THREADS; i++) {
+    err = thread_create(&th[i], spin, (void *)(intptr_t) i);
+    assert(!err);
+  }
+  for (i = 0; i < NB_THREADS; i++)
+    thread_join(th[i], NULL);
+
+  bench_mutex_contended();
+  return bench_finish();
+}
@@ -0,0 +1,180 @@
+#define _GNU_SOURCE
+#include <assert.h>
+#include <limits.h>
+#include <stdint.h>
+#include <sys/wait.h>
+#include "bench.h"
+
+/* coût d'un changement de contexte et mémoire par thread selon la profondeur de pile.
+ *
+ * pour chaque profondeur, NB_ROUND threads descendent d'autant d'octets dans leur pile
+ * puis se passent un témoin en rond (thread_wake du suivant, thread_wait_on de sa case):
+ * une mesure est un tour du témoin, soit NB_ROUND changements de contexte.
+ * pour la mémoire, NB_BLOCKED threads descendent à la même profondeur et se bloquent, et on
+ * note l'augmentation de la mémoire résidente par thread. chaque profondeur est mesurée dans
+ * un processus fils, avant toute création de thread, pour ne pas réutiliser la mémoire libérée
+ * par les mesures précédentes.
+ *
+ * à comparer entre libthread, libthreadshared (bench-stack-shared, où seule la partie
+ * utilisée de la pile est gardée, mais copiée à chaque changement de pile partagée) et pthread.
+ */
+
+#define NB_ROUND 8
+#define NB_BLOCKED 2000
+#define FRAME_SIZE 1024
+#define NB_DEPTHS 5
+
+static const size_t depths[NB_DEPTHS] = { 0, 1024, 4096, 16384, 65536 };
+static const char *switch_names[NB_DEPTHS] = {
+  "switch_depth_0", "switch_depth_1024", "switch_depth_4096", "switch_depth_16384", "switch_depth_65536"
+};
+static const char *memory_names[NB_DEPTHS] = {
+  "rss_bytes_per_thread_depth_0", "rss_bytes_per_thread_depth_1024", "rss_bytes_per_thread_depth_4096",
+  "rss_bytes_per_thread_depth_16384", "rss_bytes_per_thread_depth_65536"
+};
+
+static size_t depth;
+static struct bench_series *series;
+static int tokens[NB_ROUND];
+static volatile int stop;
+static int nb_blocked;
+static int go;
+
+/* descend de depth octets dans la pile, en écrivant chaque cadre, puis appelle func(arg) */
+static int at_depth(size_t remaining, void (*func)(int), int arg)
+{
+  char frame[FRAME_SIZE];
+  if (remaining < FRAME_SIZE) {
+    func(arg);
+    return 0;
+  }
+  memset(frame, 1, sizeof(frame));
+  return at_depth(remaining - FRAME_SIZE, func, arg) + frame[0];
+}
+
+/* le thread me attend le témoin et le passe au suivant, le thread 0 mesure chaque tour */
+static void ring(int me)
+{
+  int next = (me + 1) % NB_ROUND;
+  unsigned long long last = 0;
+  int i = 0;
+
+  while (!stop) {
+    while (__atomic_load_n(&tokens[me], __ATOMIC_ACQUIRE) == 0)
+      thread_wait_on(&tokens[me], 0);
+    tokens[me] = 0;
+    if (me == 0) {
+      unsigned long long now = bench_ticks();
+      if (i > bench_warmup)
+        bench_series_add(series, now - last);
+      last = now;
+      if (++i > bench_warmup + bench_reps)
+        stop = 1;
+    }
+    /* après stop, le témoin fait un dernier tour pour terminer les autres */
+    __atomic_store_n(&tokens[next], 1, __ATOMIC_RELEASE);
+    thread_wake(&tokens[next], 1);
+  }
+}
+
+static void block(int arg)
+{
+  (void) arg;
+  __atomic_add_fetch(&nb_blocked, 1, __ATOMIC_RELAXED);
+  while (!go)
+    thread_wait_on(&go, 0);
+}
+
+static void * ring_thread(void *arg)
+{
+  at_depth(depth, ring, (intptr_t) arg);
+  return NULL;
+}
+
+static void * blocked_thread(void *arg)
+{
+  at_depth(depth, block, 0);
+  return arg;
+}
+
+/* mémoire résidente du processus en Kio, exacte (VmRSS peut être en retard) */
+static long rss_kb(void)
+{
+  char line[256];
+  long kb = -1;
+  FILE *f = fopen("/proc/self/smaps_rollup", "r");
+  if (f == NULL)
+    return -1;
+  while (fgets(line, sizeof(line), f) != NULL)
+    if (sscanf(line, "Rss: %ld kB", &kb) == 1)
+      break;
+  fclose(f);
+  return kb;
+}
+
+/* augmentation de la mémoire résidente par thread bloqué à la profondeur depth */
+static double memory_per_thread(void)
+{
+  static thread_t th[NB_BLOCKED];
+  long before = rss_kb(), after;
+  int i, err;
+
+  go = 0;
+  nb_blocked = 0;
+  for (i = 0; i < NB_BLOCKED; i++) {
+    err = thread_create(&th[i], blocked_thread, NULL);
+    assert(!err);
+  }
+  while (__atomic_load_n(&nb_blocked, __ATOMIC_RELAXED) < NB_BLOCKED)
+    thread_yield();
+  after = rss_kb();
+  go = 1;
+  thread_wake(&go, INT_MAX);
+  for (i = 0; i < NB_BLOCKED; i++)
+    thread_join(th[i], NULL);
+  return (after - before) * 1024.0 / NB_BLOCKED;
+}
+
+int main(int argc, char *argv[])
+{
+  thread_t th[NB_ROUND];
+  int d, i, err, fds[2];
+  double bytes;
+
+  bench_init(argc, argv);
+
+  for (d = 0; d < NB_DEPTHS; d++) {
+    depth = depths[d];
+    if (pipe(fds) == -1) {
+      perror("pipe");
+      return EXIT_FAILURE;
+    }
+    if (fork() == 0) {
+      bytes = memory_per_thread();
+      if (write(fds[1], &bytes, sizeof(bytes)) != sizeof(bytes))
+        _exit(EXIT_FAILURE);
+      _exit(EXIT_SUCCESS);
+    }
+    if (read(fds[0], &bytes, sizeof(bytes)) == sizeof(bytes))
+      bench_metric(memory_names[d], bytes);
+    wait(NULL);
+    close(fds[0]);
+    close(fds[1]);
+  }
+
+  for (d = 0; d < NB_DEPTHS; d++) {
+    depth = depths[d];
+    series = bench_series_new(switch_names[d], NB_ROUND);
+    stop = 0;
+    memset(tokens, 0, sizeof(tokens));
+    tokens[0] = 1;
+    for (i = 0; i < NB_ROUND; i++) {
+      err = thread_create(&th[i], ring_thread, (void *)(intptr_t) i);
+      assert(!err);
+    }
+    for (i = 0; i < NB_ROUND; i++)
+      thread_join(th[i], NULL);
+  }
+
+  return bench_finish();
+}
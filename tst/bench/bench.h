@@ -0,0 +1,246 @@
+#ifndef __BENCH_H__
+#define __BENCH_H__
+
+/* Petit harnais de micro-benchmarks, mesurés dans le processus avec le TSC.
+ *
+ * Chaque mesure est répétée (après un échauffement) et on en garde la médiane,
+ * le p99, le p99.9 et un histogramme par puissances de 2 de ns, écrits en JSON
+ * sur la sortie standard ou dans le fichier donné par -o. Le même programme compilé avec -DUSE_PTHREAD mesure les pthreads.
+ * Des valeurs mesurées une seule fois (une mémoire par exemple) s'ajoutent avec bench_metric.
+ *
+ * options communes: -n <nombre de mesures> -w <nombre de mesures d'échauffement> -o <fichier>
+ *
+ * Le processus est fixé sur un seul cœur pour que les deux implémentations
+ * soient mesurées sur le même matériel.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <sched.h>
+#include <unistd.h>
+#include "../../src/thread.h"
+
+#ifdef USE_PTHREAD
+#define BENCH_IMPL "pthread"
+#elif defined(USE_SHARED_STACK)
+#define BENCH_IMPL "libthread-shared"
+#else
+#define BENCH_IMPL "libthread"
+#endif
+
+#define BENCH_MAX_SERIES 32
+#define BENCH_MAX_METRICS 32
+#define BENCH_CALIBRATION_NS 10 * 1000 * 1000
+#define BENCH_HISTOGRAM_BUCKETS 48
+
+struct bench_series
+{
+  const char *name;
+  unsigned long long *samples; /* en ticks TSC */
+  int nb_samples;
+  int capacity;
+  int batch;                   /* nombre d'opérations par mesure */
+};
+
+static int bench_reps = 10000;
+static int bench_warmup = 1000;
+static const char *bench_output = NULL;
+static double bench_ns_per_tick = 1.0;
+static struct bench_series bench_series_list[BENCH_MAX_SERIES];
+static int bench_nb_series = 0;
+static const char *bench_metric_names[BENCH_MAX_METRICS];
+static double bench_metric_values[BENCH_MAX_METRICS];
+static int bench_nb_metrics = 0;
+
+/* lecture du TSC, sérialisée pour ne pas mesurer les instructions voisines */
+static inline unsigned long long bench_ticks(void)
+{
+  unsigned int lo, hi;
+  __asm__ __volatile__ ("lfence\n\trdtsc" : "=a" (lo), "=d" (hi) :: "memory");
+  return ((unsigned long long)hi << 32) | lo;
+}
+
+static unsigned long long bench_monotonic_ns(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static double bench_to_ns(unsigned long long ticks)
+{
+  return ticks * bench_ns_per_tick;
+}
+
+static void bench_init(int argc, char *argv[])
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "n:w:o:")) != -1) {
+    switch (opt) {
+    case 'n': bench_reps = atoi(optarg); break;
+    case 'w': bench_warmup = atoi(optarg); break;
+    case 'o': bench_output = optarg; break;
+    default:
+      fprintf(stderr, "usage: %s [-n mesures] [-w échauffement] [-o fichier.json]\n", argv[0]);
+      exit(EXIT_FAILURE);
+    }
+  }
+
+  cpu_set_t cpus;
+  CPU_ZERO(&cpus);
+  CPU_SET(sched_getcpu(), &cpus);
+  sched_setaffinity(0, sizeof(cpus), &cpus);
+
+  unsigned long long start_ns = bench_monotonic_ns(), start_ticks = bench_ticks();
+  unsigned long long end_ns, end_ticks;
+  do {
+    end_ns = bench_monotonic_ns();
+    end_ticks = bench_ticks();
+  } while (end_ns - start_ns < BENCH_CALIBRATION_NS);
+  bench_ns_per_tick = (double)(end_ns - start_ns) / (end_ticks - start_ticks);
+}
+
+static struct bench_series *bench_series_new(const char *name, int batch)
+{
+  if (bench_nb_series == BENCH_MAX_SERIES) {
+    fprintf(stderr, "trop de séries de mesures\n");
+    exit(EXIT_FAILURE);
+  }
+  struct bench_series *series = &bench_series_list[bench_nb_series++];
+  series->name = name;
+  series->batch = batch;
+  series->nb_samples = 0;
+  series->capacity = bench_reps;
+  series->samples = malloc(series->capacity * sizeof(*series->samples));
+  if (series->samples == NULL) {
+    perror("malloc");
+    exit(EXIT_FAILURE);
+  }
+  return series;
+}
+
+static void bench_series_add(struct bench_series *series, unsigned long long ticks)
+{
+  if (series->nb_samples < series->capacity)
+    series->samples[series->nb_samples++] = ticks;
+}
+
+/* mesure op(arg), exécutée batch fois par mesure, bench_reps fois après bench_warmup échauffements */
+static inline struct bench_series *bench_run(const char *name, void (*op)(void *), void *arg, int batch)
+{
+  struct bench_series *series = bench_series_new(name, batch);
+  int i, j;
+
+  for (i = 0; i < bench_warmup; i++)
+    for (j = 0; j < batch; j++)
+      op(arg);
+
+  for (i = 0; i < bench_reps; i++) {
+    unsigned long long start = bench_ticks();
+    for (j = 0; j < batch; j++)
+      op(arg);
+    bench_series_add(series, bench_ticks() - start);
+  }
+  return series;
+}
+
+/* enregistre une valeur mesurée une seule fois, écrite telle quelle dans "metrics" */
+static inline void bench_metric(const char *name, double value)
+{
+  if (bench_nb_metrics == BENCH_MAX_METRICS) {
+    fprintf(stderr, "trop de valeurs mesurées\n");
+    exit(EXIT_FAILURE);
+  }
+  bench_metric_names[bench_nb_metrics] = name;
+  bench_metric_values[bench_nb_metrics++] = value;
+}
+
+static int bench_compare(const void *a, const void *b)
+{
+  unsigned long long x = *(const unsigned long long *)a, y = *(const unsigned long long *)b;
+  return (x > y) - (x < y);
+}
+
+/* valeur en ns par opération du percentile p (entre 0 et 1) d'une série triée */
+static double bench_percentile(struct bench_series *series, double p)
+{
+  int i = (int)(p * series->nb_samples + 0.5) - 1;
+  if (i < 0)
+    i = 0;
+  if (i >= series->nb_samples)
+    i = series->nb_samples - 1;
+  return bench_to_ns(series->samples[i]) / series->batch;
+}
+
+/* histogramme d'une série: le compartiment k compte les opérations qui ont pris entre 2^k et 2^(k+1) ns */
+static void bench_print_histogram(FILE *out, struct bench_series *series)
+{
+  unsigned long counts[BENCH_HISTOGRAM_BUCKETS] = { 0 };
+  int i, k, first = 1;
+
+  for (i = 0; i < series->nb_samples; i++) {
+    unsigned long long ns = bench_to_ns(series->samples[i]) / series->batch;
+    for (k = 0; ns > 1 && k < BENCH_HISTOGRAM_BUCKETS - 1; k++)
+      ns >>= 1;
+    counts[k]++;
+  }
+
+  fprintf(out, "\"histogram\": [");
+  for (k = 0; k < BENCH_HISTOGRAM_BUCKETS; k++) {
+    if (counts[k] == 0)
+      continue;
+    fprintf(out, "%s[%llu, %lu]", first ? "" : ", ", 1ULL << k, counts[k]);
+    first = 0;
+  }
+  fprintf(out, "]");
+}
+
+/* écrit toutes les séries en JSON, libère les mesures */
+static int bench_finish(void)
+{
+  FILE *out = stdout;
+  int i, j, first = 1;
+
+  if (bench_output != NULL && (out = fopen(bench_output, "w")) == NULL) {
+    perror(bench_output);
+    return EXIT_FAILURE;
+  }
+
+  fprintf(out, "{\"impl\": \"%s\", \"ns_per_tick\": %f, \"benchmarks\": [", BENCH_IMPL, bench_ns_per_tick);
+  for (i = 0; i < bench_nb_series; i++) {
+    struct bench_series *series = &bench_series_list[i];
+    double sum = 0;
+    if (series->nb_samples == 0)
+      continue;
+    qsort(series->samples, series->nb_samples, sizeof(*series->samples), bench_compare);
+    for (j = 0; j < series->nb_samples; j++)
+      sum += series->samples[j];
+
+    fprintf(out, "%s\n  {\"name\": \"%s\", \"samples\": %d, \"batch\": %d, \"min_ns\": %.1f, \"mean_ns\": %.1f, "
+            "\"median_ns\": %.1f, \"p99_ns\": %.1f, \"p999_ns\": %.1f, ",
+            first ? "" : ",", series->name, series->nb_samples, series->batch,
+            bench_percentile(series, 0), sum / series->nb_samples * bench_ns_per_tick / series->batch,
+            bench_percentile(series, .5), bench_percentile(series, .99), bench_percentile(series, .999));
+    bench_print_histogram(out, series);
+    fprintf(out, "}");
+    free(series->samples);
+    first = 0;
+  }
+  fprintf(out, "\n]");
+  if (bench_nb_metrics > 0) {
+    fprintf(out, ", \"metrics\": {");
+    for (i = 0; i < bench_nb_metrics; i++)
+      fprintf(out, "%s\n  \"%s\": %.1f", i == 0 ? "" : ",", bench_metric_names[i], bench_metric_values[i]);
+    fprintf(out, "\n}");
+  }
+  fprintf(out, "}\n");
+
+  if (out != stdout)
+    fclose(out);
+  return EXIT_SUCCESS;
+}
+
+#endif /* __BENCH_H__ */